@@ -3,17 +3,30 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** defines ***/
 
@@ -26,6 +39,31 @@
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 4
 #define KILO_QUIT_TIMES 3
+#define LV_LINEIDX_CHUNK 65536
+#define LV_LINEIDX_BLOCK (1 << 20)
+#define LV_RENDER_BUDGET (64 << 20)
+#define LV_HL_BLOCK 128
+#define LV_HL_IDLE_ROWS 65536
+#define LV_HL_MIN_CHUNK (64 * LV_HL_BLOCK)
+#define LV_MAX_THREADS 64
+#define LV_SEARCH_PIECE (1 << 20)
+#define LV_RE_MAX_REPEAT 1000
+#define LV_RE_MAX_STATES 100000
+#define LV_RE_DFA_STATES 1024
+#define LV_BUSY_POLL_MS 100
+#define LV_FRAME_MS 16
+#define LV_FRAME_MAX_MS 100
+#define LV_PASTE_WAIT_MS 1000
+#define LV_SAVE_IOV 1024
+#define LV_SAVE_CHUNK (8 << 20)
+#define LV_UNDO_CHUNK (1 << 20)
+#define LV_UNDO_MEMORY (16 << 20)
+#define LV_UNDO_MAX_OPS (1 << 20)
+#define LV_JOURNAL_MAGIC 0x4c56534au  // "LVSJ"
+#define LV_JOURNAL_VERSION 1
+#define LV_JOURNAL_SYNC_MS 1000
+#define LV_JOURNAL_BATCH (64 << 10)
+#define LV_STATUS_SECONDS 5
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -43,6 +81,7 @@ enum editorKey {
   END_KEY,
   PAGE_UP,
   PAGE_DOWN,
+  PASTE_START,
 };
 
 enum editorHighlight {
@@ -69,22 +108,282 @@ struct editorSyntax {
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  struct syntaxTable *table;  // filled in by editorSyntaxCompile
+};
+
+#define CC_SEPARATOR (1<<0)
+#define CC_DIGIT (1<<1)
+#define CC_COMMENT_START (1<<2)  // first byte of a comment delimiter
+
+/* Keyword slot of a perfect hash table
+ */
+struct kwslot {
+  const char *word;
+  int len;
+  unsigned char hl;
+};
+
+/* The lookup tables an editorSyntax is compiled into. Every byte is
+ * classified with a single table load, and a keyword is recognized with one
+ * hash over the word and a single slot compare.
+ */
+struct syntaxTable {
+  unsigned char cclass[256];
+  int scs_len;
+  int mcs_len;
+  int mce_len;
+  unsigned int seed;
+  unsigned int mask;  // number of keyword slots - 1
+  struct kwslot *slots;
 };
 
 typedef struct erow {
-  int idx;
   int size;
   int rsize;
   char *chars;
-  char *render;
-  char *linecol;
+  int owned;  // chars is malloc'd rather than a view into the file mapping
+  char *render;       // NULL while the row is not in the render cache
   unsigned char *hl;
-  int hl_open_comment;
+  int hl_state;         // comment state hl was lexed from, -1 if hl is stale
+  int hl_open_comment;  // comment state at the end of the row
+  struct erow *lru_prev;
+  struct erow *lru_next;
 } erow;
 
-struct cords {
+/* A node of the row tree (see the "row storage" section). The erow must stay
+ * the first member so that an erow pointer can be turned back into its node.
+ */
+typedef struct rownode {
+  erow row;
+  struct rownode *left;
+  struct rownode *right;
+  struct rownode *parent;
+  unsigned int prio;
+  int count;  // number of rows in this subtree
+  int span;   // if nonzero, the node is this many unmaterialized file lines
+  int line;   // first file line of a span
+} rownode;
+
+/* A read-only cursor over the text of consecutive rows
+ */
+struct rowiter {
+  rownode *node;
+  int off;
+  erow *row;  // the row last read, if it is materialized
+};
+
+/* A match of a search, at chars offset x of row y
+ */
+struct searchmatch {
   int x;
   int y;
+  int len;
+};
+
+/* Start offsets of the lines of the mapped file, filled in by a background
+ * thread while the editor is already running. Offsets live in fixed-size
+ * chunks so that growing the index never moves entries the main thread
+ * may be reading.
+ */
+struct lineindex {
+  size_t **chunks;
+  int nstarts;     // line starts recorded so far (worker only)
+  int published;   // lines whose extent is visible to the main thread
+  size_t scanned;  // bytes scanned so far
+  int done;
+  int crlf;        // some line ends in \r\n (worker only until done)
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+};
+
+/* A run of text being searched: part of a span, or the chars of one row
+ */
+struct searchblock {
+  const char *chars;
+  size_t len;
+  int y;       // row of the first line of the block
+  int line;    // for a span, its first file line
+  int lines;   // for a span, its number of lines; 0 for a row
+  int copied;  // chars is a private copy of an owned row
+};
+
+/* A piece of the buffer searched by one worker at a time. Its matches are
+ * only read by the main thread once it is done.
+ */
+struct searchpiece {
+  int from, to;  // blocks of the piece
+  struct searchmatch *matches;
+  int len;
+  int cap;
+  int done;
+};
+
+/* A search running on a pool of worker threads. Pieces are handed out
+ * starting from the one holding the cursor, so the next match is usually
+ * known long before the rest of the buffer has been searched.
+ */
+struct search {
+  int active;
+  char *query;  // kept after the search is done, to refine it
+  int qlen;
+  int regex;        // query is a regular expression
+  struct regex *re;
+  struct searchblock *blocks;
+  int nblocks;
+  struct searchpiece *pieces;
+  int npieces;
+  int *order;   // pieces in the order they are handed out
+  int next;     // next entry of order to hand out
+  int pending;  // pieces not done yet
+  int merged;   // done pieces already merged into E.searchhistory
+  int cancel;
+  int nthreads;
+  pthread_t threads[LV_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* A run of text being saved: the lines of a span, or the chars of one row
+ */
+struct saveblock {
+  const char *chars;
+  size_t len;
+  int line;    // for a span, its first file line
+  int lines;   // for a span, its number of lines; 0 for a row
+  int copied;  // chars is a private copy of an owned row
+};
+
+/* A save running on a writer thread. It writes a snapshot of the rows taken
+ * when it started, so editing can go on meanwhile.
+ */
+struct save {
+  int active;
+  struct saveblock *blocks;
+  int nblocks;
+  char *target;  // the file being replaced
+  char *tmp;     // where its new contents are written first, or NULL when
+                 // it is written over in place
+  int fd;
+  int dirty;     // E.dirty when the snapshot was taken
+  off_t journaled;  // where the journal ops after the snapshot start
+  off_t total;   // bytes of the buffer to write out
+  off_t done;    // bytes of it handled so far
+  int finished;
+  off_t len;     // bytes written to disk, or -1
+  int err;       // errno of the failure if len is -1
+  pthread_t thread;
+  pthread_mutex_t lock;
+};
+
+enum undoType {
+  UNDO_INSERT = 0,
+  UNDO_DELETE
+};
+
+/* An edit of the undo log: text inserted at or deleted from (x, y), which
+ * ends at (ex, ey). The text is at off in the log.
+ */
+struct undoop {
+  int type;
+  int group;     // first op of the ops undone and redone together
+  int reversed;  // the text was recorded back to front
+  int x, y;
+  int ex, ey;
+  off_t off;
+  size_t len;
+  int tick;      // key that last extended the op
+};
+
+/* Edits that can be undone, then the ones that were undone and can be
+ * redone
+ */
+struct undolog {
+  struct undoop *ops;
+  int nops;
+  int cap;
+  int pos;         // ops before pos are done, the rest undone
+  char **chunks;   // text of the ops, NULL for chunks in the spill file
+  int nchunks;
+  int resident;    // chunks in memory
+  int disk;        // chunks before this one are all in the spill file
+  int dropped;     // chunks before this one hold no history and are freed
+  off_t end;       // end of the text
+  int fd;          // spill file, -1 until one is needed
+  size_t budget;   // memory for text before it is spilled
+  int tick;        // keys read so far
+  int open;        // the last op's group takes new ops too
+  int suspended;   // edits are not being recorded
+};
+
+/* A dynamically managed string buffer
+ */
+struct abuf {
+  char *b;
+  size_t len;
+  size_t cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+/* The start of a journal: the file its ops apply to
+ */
+struct journalhead {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  int64_t mtime;  // in nanoseconds
+  uint64_t ino;
+};
+
+/* An op of a journal, followed by the text it inserts. A deletion has none.
+ */
+struct journalop {
+  uint32_t type;
+  int32_t y, x;
+  int32_t ey, ex;
+  uint32_t sum;  // hash of the text
+  uint64_t len;
+};
+
+/* The journal of the edits made since the file was last saved
+ */
+struct journal {
+  char *path;           // NULL until the journal is first needed
+  int fd;               // -1 while there is no journal
+  off_t size;           // bytes written to it
+  struct abuf pending;  // ops batched but not written yet
+  long last;            // offset in pending of the last op, or -1
+  int unsynced;         // some ops were written but not synced
+  long long synced;     // when it was last synced, in milliseconds
+  int interval;         // milliseconds between syncs
+  int failed;           // it can't be written or another lv has it, so edits
+                        // are not journaled
+};
+
+/* One character cell of the screen. attr is the SGR foreground color, 0
+ * for the default one, possibly with CELL_INVERSE set.
+ */
+struct cell {
+  char c;
+  unsigned char attr;
+};
+
+#define CELL_INVERSE 0x80
+
+/* Frames are drawn into back, then compared with front so only the cells
+ * that changed are written to the terminal
+ */
+struct screen {
+  struct cell *front;  // what the terminal shows
+  struct cell *back;   // the frame being drawn
+  int cx, cy;          // where the terminal cursor was left
+  int rowoff;          // E.rowoff of the frame on the terminal
+  long long drawn;     // when a frame was last written, in milliseconds
+  struct abuf out;     // output of the last frame, kept for its capacity
+  int *ranges;         // match columns of the row being drawn
+  char sgr[128][8];    // escape sequences setting each foreground color
+  unsigned char sgrlen[128];
 };
 
 struct editorConfig {
@@ -96,14 +395,40 @@ struct editorConfig {
   int screencols;
   int numrows;
   int lncolwidth;
-  erow *rows;
+  rownode *rows;
+  char *map;        // read-only mapping of the opened file
+  int mapfd;        // the mapped file, kept open to copy unedited lines from
+  size_t mapsize;
+  struct lineindex lineidx;
+  int loading;      // the line index is still being built
+  int loadedlines;  // mapped lines that have been added to the row tree
+  erow *lru_head;   // rows holding render and hl, most recently used first
+  erow *lru_tail;
+  size_t rendermem;
+  size_t renderbudget;
+  unsigned char *hlcheck;  // comment state at the start of every row block
+  int hlcheckcap;
+  int hlvalid;             // leading blocks whose checkpoint is up to date
+  struct search search;
+  struct save save;
+  struct undolog undo;
+  struct journal journal;
   int sh_len;
-  struct cords *searchhistory;
+  struct searchmatch *searchhistory;  // matches of the last search
+  int sh_cap;
+  int sh_marked;                // matches are drawn until the next edit
   int dirty;
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
+  struct editorSyntax **syntaxes;  // loaded definitions, then HLDB
+  int nsyntaxes;
+  struct screen screen;
+  int winch[2];  // pipe written to on SIGWINCH, SIGHUP and SIGTERM
+  volatile sig_atomic_t hangup;  // SIGHUP or SIGTERM was received
+  struct abuf keys;  // input read ahead of the key decoder
+  size_t keypos;     // next byte of keys to decode
   struct termios orig_termios;
 };
 
@@ -127,7 +452,8 @@ struct editorSyntax HLDB[] = {
     C_HL_extensions,
     C_HL_keywords,
     "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL
   },
 };
 
@@ -136,12 +462,36 @@ struct editorSyntax HLDB[] = {
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
+char *abReserve(struct abuf *ab, int len);
+void abAppend(struct abuf *ab, const char *s, int len);
 void editorRefreshScreen();
+void editorUpdateRow(erow *row);
+void editorRenderCacheDrop(erow *row);
+int editorLoadPoll();
+void editorLoadWait(int lines);
+void editorLoadTail();
+int editorSearchPoll();
+int editorSavePoll();
+void editorSearchStop();
+int editorSyntaxIdle();
+void screenResize();
+void editorFreeRow(erow *row);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorUndoRecord(int type, int y, int x, const char *s, size_t len,
+                      int eol);
+void editorDeleteText(int y, int x, int ey, int ex);
+void editorJournalRecord(int type, int y, int x, int ey, int ex,
+                         const char *s, size_t len, int eol);
+int editorJournalDue();
+void editorJournalSync();
+void editorSaveWait();
 
 /*** terminal ***/
 
 void die(const char *s) {
+  // Whatever was edited can still be recovered from the journal
+  editorJournalSync();
+
   write(STDOUT_FILENO, "\x1b[2J", 4);
   write(STDOUT_FILENO, "\x1b[1;1H", 3);
 
@@ -150,6 +500,7 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);  // Stop bracketing pastes
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -167,25 +518,174 @@ void enableRawMode() {
   raw.c_cc[VTIME] = 1;
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+  // Have the terminal mark pasted text so it can be inserted in one go
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+static void editorHandleWinch(int sig) {
+  (void)sig;
+  int saved = errno;
+  write(E.winch[1], "", 1);
+  errno = saved;
+}
+
+/* Leaves the edits in the journal when the terminal goes away or the editor
+ * is told to quit. The main loop does that once it sees the flag.
+ */
+static void editorHandleHangup(int sig) {
+  (void)sig;
+  int saved = errno;
+  E.hangup = 1;
+  write(E.winch[1], "", 1);
+  errno = saved;
+}
+
+/* Has SIGWINCH wake up editorWaitKey through the E.winch pipe
+ */
+void editorWatchResize() {
+  if (pipe(E.winch) == -1) die("pipe");
+  for (int j = 0; j < 2; j++)
+    fcntl(E.winch[j], F_SETFL, fcntl(E.winch[j], F_GETFL) | O_NONBLOCK);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleWinch;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+
+  sa.sa_handler = editorHandleHangup;
+  if (sigaction(SIGHUP, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1)
+    die("sigaction");
+}
+
+/* Leaves once the terminal is gone, keeping the edits in the journal
+ */
+static void editorHangup() {
+  editorSaveWait();
+  editorJournalSync();
+  exit(1);
+}
+
+/* Returns the time in milliseconds on a clock that only goes forward
+ */
+long long editorNowMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Returns 1 if a key can be read within ms milliseconds
+ */
+int editorKeyPending(int ms) {
+  if (E.keypos < E.keys.len) return 1;
+  struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+  return poll(&fd, 1, ms) > 0;
+}
+
+/* Returns the milliseconds left until the status message goes away, or -1
+ * if none is shown
+ */
+static int editorStatusMessageLeft() {
+  if (E.statusmsg[0] == '\0') return -1;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  long long left = (long long)(E.statusmsg_time + LV_STATUS_SECONDS -
+                               now.tv_sec) * 1000 - now.tv_nsec / 1000000;
+  return left > 0 ? left : -1;
+}
+
+/* Sleeps until a key can be read. Until then the editor only wakes up to
+ * follow the indexer, a running search and a running save, to handle a
+ * resize or a hangup, to clear an expired status message, to sync the
+ * journal and to bring stale syntax checkpoints up to date.
+ */
+static void editorWaitKey() {
+  int idle = 1;  // checkpoints may still be stale
+  while (E.keypos == E.keys.len) {
+    int timeout = -1;
+    if (E.loading || E.search.active || E.save.active)
+      timeout = LV_BUSY_POLL_MS;
+    int msg = editorStatusMessageLeft();
+    if (msg >= 0 && (timeout < 0 || msg < timeout)) timeout = msg;
+    if (idle) timeout = 0;
+    // Journaled edits are synced once they are due
+    int due = editorJournalDue();
+    if (due == 0) {
+      editorJournalSync();
+      due = editorJournalDue();
+    }
+    if (due >= 0 && (timeout < 0 || due < timeout)) timeout = due;
+
+    struct pollfd fds[2] = {
+      {STDIN_FILENO, POLLIN, 0},
+      {E.winch[0], POLLIN, 0},
+    };
+    if (poll(fds, 2, timeout) == -1 && errno != EINTR) die("poll");
+    if (E.hangup || (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)))
+      editorHangup();
+    if (fds[0].revents) return;
+
+    // Keep the screen in step with the file while it is still being indexed,
+    // with the matches of a search that is still running and with a save
+    int changed = editorLoadPoll();
+    changed |= editorSearchPoll();
+    changed |= editorSavePoll();
+    if (fds[1].revents) {
+      char buf[64];
+      while (read(E.winch[0], buf, sizeof(buf)) > 0);
+      screenResize();
+      changed = 1;
+    }
+    if (msg >= 0 && editorStatusMessageLeft() < 0) changed = 1;
+
+    if (changed) editorRefreshScreen();
+    else if (idle) idle = editorSyntaxIdle();
+  }
+}
+
+/* Reads one byte of input, taking what was read ahead first
+ */
+static int editorReadByte(char *c) {
+  if (E.keypos < E.keys.len) {
+    *c = E.keys.b[E.keypos++];
+    return 1;
+  }
+  return read(STDIN_FILENO, c, 1);
 }
 
 int editorReadKey() {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
+  editorWaitKey();
+  while ((nread = editorReadByte(&c)) != 1) {
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    // Input was ready, so nothing at all means the terminal is gone
+    if (nread == 0) editorHangup();
+    editorWaitKey();
   }
 
   if (c == '\x1b') {
-    char seq[3];
+    char seq[5];
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (editorReadByte(&seq[0]) != 1) return '\x1b';
+    if (editorReadByte(&seq[1]) != 1) return '\x1b';
 
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
         // Process Page_up and Page_down keys
-        if (read(STDIN_FILENO, &seq[2], 1)!= 1) return '\x1b';
+        if (editorReadByte(&seq[2]) != 1) return '\x1b';
+        if (seq[2] >= '0' && seq[2] <= '9') {
+          if (editorReadByte(&seq[3]) != 1) return '\x1b';
+          // The start of a bracketed paste is \x1b[200~
+          if (seq[1] == '2' && seq[2] == '0' && seq[3] == '0') {
+            if (editorReadByte(&seq[4]) != 1) return '\x1b';
+            if (seq[4] == '~') return PASTE_START;
+          }
+          // Keys with two digits, such as F9 (\x1b[20~), aren't bound
+          return '\x1b';
+        }
         if (seq[2] == '~') {
           switch (seq[1]) {
             case '1': return HOME_KEY;
@@ -220,6 +720,42 @@ int editorReadKey() {
   }
 }
 
+/* Reads the text of a bracketed paste into ab, up to the \x1b[201~ that
+ * closes it. Input read past the end of the paste is kept for
+ * editorReadKey. A paste that stalls for LV_PASTE_WAIT_MS is taken as
+ * complete.
+ */
+void editorReadPaste(struct abuf *ab) {
+  static const char close[] = "\x1b[201~";
+  int closelen = sizeof(close) - 1;
+  ab->len = 0;
+  while (1) {
+    if (E.keypos == E.keys.len) {
+      E.keys.len = E.keypos = 0;
+      if (!editorKeyPending(LV_PASTE_WAIT_MS)) return;
+      char *p = abReserve(&E.keys, 4096);
+      if (p == NULL) return;
+      int n = read(STDIN_FILENO, p, 4096);
+      if (n == -1 && errno != EAGAIN && errno != EINTR) die("read");
+      if (n == 0) return;  // the terminal is gone
+      if (n > 0) E.keys.len = n;
+      continue;
+    }
+
+    size_t from = ab->len > (size_t)closelen ? ab->len - closelen : 0;
+    abAppend(ab, &E.keys.b[E.keypos], E.keys.len - E.keypos);
+    E.keypos = E.keys.len;
+    char *end = memmem(&ab->b[from], ab->len - from, close, closelen);
+    if (end != NULL) {
+      // Bytes after the closing sequence are typed keys, not pasted text
+      size_t after = ab->len - (end - ab->b) - closelen;
+      E.keypos = E.keys.len - after;
+      ab->len = end - ab->b;
+      return;
+    }
+  }
+}
+
 /* Gets the current cursor position and writes the result into row and col
  */
 int getCursorPosition(int *row, int *col) {
@@ -256,59 +792,519 @@ int getWindowSize(int* row, int* col) {
   }
 }
 
+/*** line index ***/
+
+/* Returns the offset of the start of a line of the mapped file. Asking for
+ * the line after the last one gives one past its terminating '\n'.
+ */
+size_t editorLineStart(int line) {
+  return E.lineidx.chunks[line / LV_LINEIDX_CHUNK][line % LV_LINEIDX_CHUNK];
+}
+
+static void lineIndexAdd(struct lineindex *li, size_t start) {
+  // Saving drops the \r, so such a file can't be copied back as it is
+  if (start >= 2 && start <= E.mapsize && E.map[start - 2] == '\r')
+    li->crlf = 1;
+  int n = li->nstarts;
+  if (n % LV_LINEIDX_CHUNK == 0)
+    li->chunks[n / LV_LINEIDX_CHUNK] = malloc(sizeof(size_t) * LV_LINEIDX_CHUNK);
+  li->chunks[n / LV_LINEIDX_CHUNK][n % LV_LINEIDX_CHUNK] = start;
+  li->nstarts++;
+}
+
+/* Records the start of every line that begins in map[from, to)
+ */
+static void lineIndexScan(struct lineindex *li, size_t from, size_t to) {
+  const char *map = E.map;
+  size_t pos = from;
+#ifdef __SSE2__
+  // Compare 16 bytes at a time and walk the bits of the newline mask
+  const __m128i nl = _mm_set1_epi8('\n');
+  while (pos + 16 <= to) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&map[pos]);
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    while (mask) {
+      lineIndexAdd(li, pos + __builtin_ctz(mask) + 1);
+      mask &= mask - 1;
+    }
+    pos += 16;
+  }
+#endif
+  while (pos < to) {
+    const char *p = memchr(&map[pos], '\n', to - pos);
+    if (p == NULL) break;
+    pos = (p - map) + 1;
+    lineIndexAdd(li, pos);
+  }
+}
+
+/* Background thread that indexes the mapped file a block at a time and
+ * publishes the lines found after each block
+ */
+static void *lineIndexWorker(void *arg) {
+  struct lineindex *li = arg;
+  size_t pos = 0;
+  size_t block = LV_LINEIDX_BLOCK / 16;  // Start small to get a screenful out fast
+
+  while (pos < E.mapsize) {
+    size_t to = pos + block < E.mapsize ? pos + block : E.mapsize;
+    lineIndexScan(li, pos, to);
+    pos = to;
+    block = LV_LINEIDX_BLOCK;
+
+    // A last line without a '\n' still needs an end
+    if (pos == E.mapsize && E.map[pos - 1] != '\n') lineIndexAdd(li, pos + 1);
+
+    pthread_mutex_lock(&li->lock);
+    li->published = li->nstarts - 1;
+    li->scanned = pos;
+    li->done = (pos == E.mapsize);
+    pthread_cond_broadcast(&li->cond);
+    pthread_mutex_unlock(&li->lock);
+  }
+  return NULL;
+}
+
+/* Starts indexing the lines of the mapped file in the background
+ */
+void editorLineIndexStart() {
+  struct lineindex *li = &E.lineidx;
+  // A file has at most one line per byte, plus the end of the last one
+  li->chunks = malloc(sizeof(size_t *) * (E.mapsize / LV_LINEIDX_CHUNK + 2));
+  li->nstarts = 0;
+  li->published = 0;
+  li->scanned = 0;
+  li->done = 0;
+  li->crlf = 0;
+  pthread_mutex_init(&li->lock, NULL);
+  pthread_cond_init(&li->cond, NULL);
+  lineIndexAdd(li, 0);
+
+  E.loading = 1;
+  E.loadedlines = 0;
+  if (pthread_create(&li->thread, NULL, lineIndexWorker, li) != 0)
+    die("pthread_create");
+}
+
+/*** row storage ***/
+
+/*
+ * Rows are kept in an implicit-key treap instead of a flat array. Each node
+ * holds one erow and the number of rows in its subtree, so looking up,
+ * inserting or deleting the row at a given index costs O(log n) and never
+ * touches the rest of the file. Parent pointers let a row find its own index
+ * and its neighbours without searching from the root.
+ *
+ * A node can also be a span: a run of consecutive lines of the mapped file
+ * that have never been looked at. Spans carry no erow state at all. When a
+ * row inside a span is needed it is split out into its own node holding a
+ * view into the mapping (see editorRowAt).
+ */
+
+static unsigned int rowTreeRand() {
+  static unsigned int seed = 2463534242u;
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static int rowTreeCount(rownode *n) {
+  return n ? n->count : 0;
+}
+
+/* Number of rows held by the node itself
+ */
+static int rowTreeWeight(rownode *n) {
+  return n->span ? n->span : 1;
+}
+
+/* Recomputes the subtree count of n and relinks its children to it
+ */
+static void rowTreePull(rownode *n) {
+  n->count = rowTreeWeight(n) + rowTreeCount(n->left) + rowTreeCount(n->right);
+  if (n->left) n->left->parent = n;
+  if (n->right) n->right->parent = n;
+}
+
+static rownode *rowTreeNewSpan(int line, int span, unsigned int prio) {
+  rownode *n = malloc(sizeof(rownode));
+  n->left = n->right = n->parent = NULL;
+  n->prio = prio;
+  n->span = span;
+  n->line = line;
+  n->count = span;
+  return n;
+}
+
+/* Joins two trees where every row of l comes before every row of r
+ */
+static rownode *rowTreeMerge(rownode *l, rownode *r) {
+  if (l == NULL) return r;
+  if (r == NULL) return l;
+  if (l->prio > r->prio) {
+    l->right = rowTreeMerge(l->right, r);
+    rowTreePull(l);
+    l->parent = NULL;
+    return l;
+  } else {
+    r->left = rowTreeMerge(l, r->left);
+    rowTreePull(r);
+    r->parent = NULL;
+    return r;
+  }
+}
+
+/* Splits t so that the first k rows end up in *l and the rest in *r.
+ * A span straddling the split point is cut in two. The second piece is a
+ * new node, so it gets a priority of its own and is merged back in rather
+ * than taking its parent's place, or cutting a span row by row would
+ * leave a chain of equal priorities.
+ */
+static void rowTreeSplit(rownode *t, int k, rownode **l, rownode **r) {
+  if (t == NULL) {
+    *l = *r = NULL;
+    return;
+  }
+  int lc = rowTreeCount(t->left);
+  if (k <= lc) {
+    rowTreeSplit(t->left, k, l, &t->left);
+    rowTreePull(t);
+    *r = t;
+  } else if (k >= lc + rowTreeWeight(t)) {
+    rowTreeSplit(t->right, k - lc - rowTreeWeight(t), &t->right, r);
+    rowTreePull(t);
+    *l = t;
+  } else {
+    int cut = k - lc;
+    rownode *t2 = rowTreeNewSpan(t->line + cut, t->span - cut, rowTreeRand());
+    rownode *right = t->right;
+    t->span = cut;
+    t->right = NULL;
+    rowTreePull(t);
+    if (right) right->parent = NULL;
+    *l = t;
+    *r = rowTreeMerge(t2, right);
+  }
+  t->parent = NULL;
+}
+
+/* Links a tree of fresh nodes into the tree so that its first row becomes
+ * row `at`
+ */
+static void rowTreeInsertTree(int at, rownode *t) {
+  rownode *l, *r;
+  rowTreeSplit(E.rows, at, &l, &r);
+  E.rows = rowTreeMerge(rowTreeMerge(l, t), r);
+}
+
+/* Links a fresh node into the tree so that its first row becomes row `at`
+ */
+static void rowTreeInsert(int at, rownode *n) {
+  n->left = n->right = n->parent = NULL;
+  n->prio = rowTreeRand();
+  rowTreePull(n);
+  rowTreeInsertTree(at, n);
+}
+
+/* Unlinks row `at` from the tree and returns its node
+ */
+static rownode *rowTreeRemove(int at) {
+  rownode *l, *m, *r;
+  rowTreeSplit(E.rows, at, &l, &r);
+  rowTreeSplit(r, 1, &m, &r);
+  E.rows = rowTreeMerge(l, r);
+  return m;
+}
+
+/* Unlinks rows [at, at + n) from the tree and returns them as a tree of
+ * their own
+ */
+static rownode *rowTreeRemoveRange(int at, int n) {
+  rownode *l, *m, *r;
+  rowTreeSplit(E.rows, at, &l, &r);
+  rowTreeSplit(r, n, &m, &r);
+  E.rows = rowTreeMerge(l, r);
+  return m;
+}
+
+/* Frees a tree of unlinked nodes
+ */
+static void rowTreeFree(rownode *t) {
+  if (t == NULL) return;
+  rowTreeFree(t->left);
+  rowTreeFree(t->right);
+  if (!t->span) editorFreeRow(&t->row);
+  free(t);
+}
+
+/* Returns the node holding row `at` and writes the row's offset inside
+ * that node into *off
+ */
+static rownode *rowTreeFind(int at, int *off) {
+  rownode *n = E.rows;
+  while (1) {
+    int lc = rowTreeCount(n->left);
+    if (at < lc) {
+      n = n->left;
+    } else if (at < lc + rowTreeWeight(n)) {
+      *off = at - lc;
+      return n;
+    } else {
+      at -= lc + rowTreeWeight(n);
+      n = n->right;
+    }
+  }
+}
+
+static rownode *rowTreeNextNode(rownode *n) {
+  if (n->right) {
+    n = n->right;
+    while (n->left) n = n->left;
+    return n;
+  }
+  while (n->parent && n == n->parent->right) n = n->parent;
+  return n->parent;
+}
+
+static rownode *rowTreePrevNode(rownode *n) {
+  if (n->left) {
+    n = n->left;
+    while (n->right) n = n->right;
+    return n;
+  }
+  while (n->parent && n == n->parent->left) n = n->parent;
+  return n->parent;
+}
+
+/* Returns the text of a line of the mapped file, without its line ending
+ */
+static char *editorMapLine(int line, int *len) {
+  size_t start = editorLineStart(line);
+  size_t end = editorLineStart(line + 1) - 1;
+  while (end > start && E.map[end - 1] == '\r') end--;
+  *len = end - start;
+  return &E.map[start];
+}
+
+/* Splits row `at` out of the span holding it and turns it into a row that
+ * views its text in the mapping
+ */
+static rownode *rowTreeMaterialize(int at) {
+  rownode *l, *m, *r;
+  rowTreeSplit(E.rows, at, &l, &r);
+  rowTreeSplit(r, 1, &m, &r);
+  // The row is a node of its own from now on, with a priority of its own
+  m->prio = rowTreeRand();
+  E.rows = rowTreeMerge(rowTreeMerge(l, m), r);
+
+  erow *row = &m->row;
+  row->chars = editorMapLine(m->line, &row->size);
+  row->owned = 0;
+  m->span = 0;
+
+  // Render and highlight are only built once something needs them
+  row->rsize = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_state = -1;
+  row->hl_open_comment = 0;
+  row->lru_prev = row->lru_next = NULL;
+  return m;
+}
+
+/* Returns the row at the given index, or NULL if it is out of range
+ */
+erow *editorRowAt(int at) {
+  if (at < 0 || at >= rowTreeCount(E.rows)) return NULL;
+  int off;
+  rownode *n = rowTreeFind(at, &off);
+  if (n->span) n = rowTreeMaterialize(at);
+  return &n->row;
+}
+
+/* Returns the index of a row that is currently linked into the tree
+ */
+int editorRowIndex(erow *row) {
+  rownode *n = (rownode *)row;
+  int at = rowTreeCount(n->left);
+  while (n->parent) {
+    if (n == n->parent->right)
+      at += rowTreeCount(n->parent->left) + rowTreeWeight(n->parent);
+    n = n->parent;
+  }
+  return at;
+}
+
+erow *editorRowNext(erow *row) {
+  rownode *n = rowTreeNextNode((rownode *)row);
+  if (n == NULL) return NULL;
+  if (n->span) return editorRowAt(editorRowIndex(row) + 1);
+  return &n->row;
+}
+
+erow *editorRowPrev(erow *row) {
+  rownode *n = rowTreePrevNode((rownode *)row);
+  if (n == NULL) return NULL;
+  if (n->span) return editorRowAt(editorRowIndex(row) - 1);
+  return &n->row;
+}
+
+/* Positions a read-only cursor on row `at`. Walking rows this way reads
+ * spans straight from the mapping and never splits them.
+ */
+void editorRowIterInit(struct rowiter *it, int at) {
+  it->node = NULL;
+  it->off = 0;
+  if (at < 0 || at >= rowTreeCount(E.rows)) return;
+  it->node = rowTreeFind(at, &it->off);
+}
+
+/* Reads the text of the next row into *chars and *len.
+ * Returns 0 once every row has been read.
+ */
+int editorRowIterNext(struct rowiter *it, char **chars, int *len) {
+  rownode *n = it->node;
+  if (n == NULL) return 0;
+  if (n->span) {
+    *chars = editorMapLine(n->line + it->off, len);
+    it->row = NULL;
+  } else {
+    *chars = n->row.chars;
+    *len = n->row.size;
+    it->row = &n->row;
+  }
+  if (++it->off >= rowTreeWeight(n)) {
+    it->node = rowTreeNextNode(n);
+    it->off = 0;
+  }
+  return 1;
+}
+
 /*** syntax highlighting ***/
 
-int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+static unsigned int syntaxHash(unsigned int h, unsigned char c) {
+  return (h ^ c) * 16777619u;
 }
 
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+/* Compiles a syntax's separators, comment delimiters and keywords into the
+ * lookup tables syntaxLex runs on. Keywords go into a perfect hash table:
+ * seeds are tried until no two keywords share a slot, growing the table
+ * whenever a size runs out of seeds.
+ */
+void editorSyntaxCompile(struct editorSyntax *syntax) {
+  struct syntaxTable *t = calloc(1, sizeof(struct syntaxTable));
 
-  if (E.syntax == NULL) return;
+  for (int c = 0; c < 256; c++) {
+    if (isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL)
+      t->cclass[c] |= CC_SEPARATOR;
+    if (isdigit(c)) t->cclass[c] |= CC_DIGIT;
+  }
+
+  char *scs = syntax->singleline_comment_start;
+  char *mcs = syntax->multiline_comment_start;
+  char *mce = syntax->multiline_comment_end;
+  t->scs_len = scs ? strlen(scs) : 0;
+  t->mcs_len = mcs ? strlen(mcs) : 0;
+  t->mce_len = mce ? strlen(mce) : 0;
+  if (t->scs_len) t->cclass[(unsigned char)scs[0]] |= CC_COMMENT_START;
+  if (t->mcs_len) t->cclass[(unsigned char)mcs[0]] |= CC_COMMENT_START;
+
+  int nkeywords = 0;
+  while (syntax->keywords[nkeywords]) nkeywords++;
+
+  unsigned int size = 1;
+  while (size < 2 * (unsigned int)nkeywords) size <<= 1;
 
-  char **keywords = E.syntax->keywords;
+  while (1) {
+    t->mask = size - 1;
+    t->slots = calloc(size, sizeof(struct kwslot));
+    for (t->seed = 2166136261u; t->seed < 2166136261u + 64; t->seed++) {
+      int ok = 1;
+      memset(t->slots, 0, size * sizeof(struct kwslot));
+      for (int j = 0; ok && j < nkeywords; j++) {
+        const char *word = syntax->keywords[j];
+        int len = strlen(word);
+        int kw2 = len && word[len - 1] == '|';
+        if (kw2) len--;
+        if (len == 0) continue;
+
+        unsigned int h = t->seed;
+        for (int k = 0; k < len; k++) h = syntaxHash(h, word[k]);
+        struct kwslot *slot = &t->slots[h & t->mask];
+        if (slot->word) {
+          // A repeated keyword keeps its first meaning
+          ok = (slot->len == len && !memcmp(slot->word, word, len));
+          continue;
+        }
+        slot->word = word;
+        slot->len = len;
+        slot->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+      }
+      if (ok) {
+        syntax->table = t;
+        return;
+      }
+    }
+    free(t->slots);
+    size <<= 1;
+  }
+}
+
+/* Runs the highlighter over one line of text, starting in the given
+ * comment state, and returns the comment state at the end of the line.
+ * hl may be NULL when only that state is wanted; numbers and keywords are
+ * skipped then, since they can't open or close anything.
+ */
+static int syntaxLex(const char *text, int len, unsigned char *hl,
+                     int in_comment) {
+  const struct syntaxTable *t = E.syntax->table;
 
   char *scs = E.syntax->singleline_comment_start;
   char *mcs = E.syntax->multiline_comment_start;
   char *mce = E.syntax->multiline_comment_end;
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mcs ? strlen(mce) : 0;
+  int scs_len = t->scs_len;
+  int mcs_len = t->mcs_len;
+  int mce_len = t->mce_len;
 
   int prev_sep = 1;
   int in_string = 0;
-  int in_comment = (row->idx > 0 && E.rows[row->idx - 1].hl_open_comment);
 
   int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
+  while (i < len) {
+    unsigned char c = text[i];
+    int cls = t->cclass[c];
+    unsigned char prev_hl = (hl && i > 0) ? hl[i - 1] : HL_NORMAL;
+
+    if (mcs_len && mce_len && in_comment) {
+      // Jump straight to the next byte that could end the comment
+      const char *end = memchr(&text[i], mce[0], len - i);
+      int j = end ? end - text : len;
+      if (hl) memset(&hl[i], HL_ML_COMMENT, j - i);
+      i = j;
+      if (i == len) break;
+
+      if (len - i >= mce_len && !memcmp(&text[i], mce, mce_len)) {
+        if (hl) memset(&hl[i], HL_ML_COMMENT, mce_len);
+        i += mce_len;
+        in_comment = 0;
+        prev_sep = 1;
+      } else {
+        if (hl) hl[i] = HL_ML_COMMENT;
+        i++;
       }
+      continue;
     }
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_ML_COMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_ML_COMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_ML_COMMENT, mcs_len);
+    if ((cls & CC_COMMENT_START) && !in_string) {
+      if (scs_len && len - i >= scs_len && !memcmp(&text[i], scs, scs_len)) {
+        if (hl) memset(&hl[i], HL_COMMENT, len - i);
+        break;
+      }
+      if (mcs_len && mce_len && len - i >= mcs_len &&
+          !memcmp(&text[i], mcs, mcs_len)) {
+        if (hl) memset(&hl[i], HL_ML_COMMENT, mcs_len);
         i += mcs_len;
         in_comment = 1;
         continue;
@@ -317,9 +1313,9 @@ void editorUpdateSyntax(erow *row) {
 
     if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
       if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->size) {
-          row->hl[i + 1] = HL_STRING;
+        if (hl) hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < len) {
+          if (hl) hl[i + 1] = HL_STRING;
           i += 2;
           continue;
         }
@@ -330,17 +1326,22 @@ void editorUpdateSyntax(erow *row) {
       } else {
         if (c == '"' || c == '\'') {
           in_string = c;
-          row->hl[i] = HL_STRING;
+          if (hl) hl[i] = HL_STRING;
           i++;
           continue;
         }
       }
     }
 
+    if (hl == NULL) {
+      i++;
+      continue;
+    }
+
     if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+      if (((cls & CC_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) ||
           (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
+        hl[i] = HL_NUMBER;
         prev_sep = 0;
         i++;
         continue;
@@ -348,39 +1349,216 @@ void editorUpdateSyntax(erow *row) {
     }
 
     if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--;
-
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
+      // A keyword has to be a whole word, so hash the word and look it up
+      unsigned int h = t->seed;
+      int j = i;
+      while (j < len && !(t->cclass[(unsigned char)text[j]] & CC_SEPARATOR))
+        h = syntaxHash(h, text[j++]);
+
+      struct kwslot *slot = &t->slots[h & t->mask];
+      if (j > i && slot->word && slot->len == j - i &&
+          !memcmp(&text[i], slot->word, j - i)) {
+        memset(&hl[i], slot->hl, j - i);
+        i = j;
         prev_sep = 0;
         continue;
       }
     }
 
-    prev_sep = is_separator(c);
+    prev_sep = (cls & CC_SEPARATOR) != 0;
     i++;
   }
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.rows[row->idx + 1]);
+  return in_comment;
 }
 
-int editorSyntaxToColor(int hl) {
-  switch (hl) {
-    case HL_COMMENT:
-    case HL_ML_COMMENT: return 90;
+/* Highlights the render of a row, which starts in the given comment state
+ */
+void editorUpdateSyntax(erow *row, int in_comment) {
+  row->hl = realloc(row->hl, row->rsize);
+  memset(row->hl, HL_NORMAL, row->rsize);
+  row->hl_state = in_comment;
+  row->hl_open_comment = 0;
+
+  if (E.syntax == NULL) return;
+  row->hl_open_comment = syntaxLex(row->render, row->rsize, row->hl, in_comment);
+}
+
+/*
+ * Whether a row starts inside a block comment depends on every row above
+ * it. Rather than storing that per row and pushing changes down the file,
+ * the state at the start of every LV_HL_BLOCK rows is kept as a checkpoint.
+ * An edit only marks the checkpoints after it as stale; the state of any
+ * row is found by lexing forward from the nearest valid checkpoint, and
+ * stale checkpoints are brought up to date when they are needed or while
+ * the editor is idle.
+ */
+
+/* Marks every checkpoint that depends on row `at` as stale
+ */
+void editorSyntaxInvalidate(int at) {
+  int block = at / LV_HL_BLOCK + 1;
+  if (block < E.hlvalid) E.hlvalid = block;
+}
+
+static void syntaxReserveCheckpoints(int nblocks) {
+  if (nblocks > E.hlcheckcap) {
+    while (nblocks > E.hlcheckcap) E.hlcheckcap *= 2;
+    E.hlcheck = realloc(E.hlcheck, E.hlcheckcap);
+  }
+}
+
+/* Comment state at the end of a row, reusing its hl when that is current
+ */
+static int syntaxRowExit(struct rowiter *it, char *chars, int len, int state) {
+  if (it->row && it->row->hl && it->row->hl_state == state)
+    return it->row->hl_open_comment;
+  return syntaxLex(chars, len, NULL, state);
+}
+
+/* Lexes forward from the last valid checkpoint, making checkpoints valid up
+ * to and including `block`, but lexing at most `maxrows` rows
+ */
+static void syntaxRevalidate(int block, int maxrows) {
+  int nblocks = E.numrows / LV_HL_BLOCK + 1;
+  if (block >= nblocks) block = nblocks - 1;
+  if (E.hlvalid > block) return;
+
+  syntaxReserveCheckpoints(nblocks);
+
+  int at = (E.hlvalid - 1) * LV_HL_BLOCK;
+  int state = E.hlcheck[E.hlvalid - 1];
+  struct rowiter it;
+  char *chars;
+  int len;
+  editorRowIterInit(&it, at);
+  while (E.hlvalid <= block && maxrows-- > 0 &&
+         editorRowIterNext(&it, &chars, &len)) {
+    state = syntaxRowExit(&it, chars, len, state);
+    if (++at % LV_HL_BLOCK == 0) E.hlcheck[E.hlvalid++] = state;
+  }
+}
+
+/* Returns the comment state at the start of row `at`
+ */
+int editorSyntaxStateAt(int at) {
+  if (E.syntax == NULL) return 0;
+
+  int block = at / LV_HL_BLOCK;
+  syntaxRevalidate(block, INT_MAX);
+  int state = E.hlcheck[block];
+
+  struct rowiter it;
+  char *chars;
+  int len;
+  editorRowIterInit(&it, block * LV_HL_BLOCK);
+  for (int j = block * LV_HL_BLOCK; j < at; j++) {
+    editorRowIterNext(&it, &chars, &len);
+    state = syntaxRowExit(&it, chars, len, state);
+  }
+  return state;
+}
+
+/* Brings a bounded number of stale checkpoints up to date.
+ * Returns 1 if there was anything to do.
+ */
+int editorSyntaxIdle() {
+  if (E.syntax == NULL || E.hlvalid > E.numrows / LV_HL_BLOCK) return 0;
+  syntaxRevalidate(INT_MAX, LV_HL_IDLE_ROWS);
+  return 1;
+}
+
+/* A run of whole blocks lexed by one thread of editorSyntaxScanAll. Since
+ * the comment state it starts in is not known yet, it is lexed from both
+ * states, recording the checkpoints each one would produce.
+ */
+struct hlchunk {
+  pthread_t thread;
+  int threaded;            // the chunk runs on its own thread
+  int from;                // first row, at a block boundary
+  int to;                  // one past the last row
+  unsigned char *check[2]; // checkpoints after `from`, for either start state
+  int exit[2];             // state at `to`, for either start state
+};
+
+static void *syntaxChunkWorker(void *arg) {
+  struct hlchunk *c = arg;
+  int s0 = 0, s1 = 1;
+  int converged = 0;
+  struct rowiter it;
+  char *chars;
+  int len;
+
+  editorRowIterInit(&it, c->from);
+  for (int at = c->from; at < c->to; ) {
+    editorRowIterNext(&it, &chars, &len);
+    s0 = syntaxRowExit(&it, chars, len, s0);
+    // Once both guesses agree at a row boundary they agree from there on
+    if (converged) {
+      s1 = s0;
+    } else {
+      s1 = syntaxRowExit(&it, chars, len, s1);
+      converged = (s0 == s1);
+    }
+    if (++at % LV_HL_BLOCK == 0) {
+      int b = (at - c->from) / LV_HL_BLOCK - 1;
+      c->check[0][b] = s0;
+      c->check[1][b] = s1;
+    }
+  }
+  c->exit[0] = s0;
+  c->exit[1] = s1;
+  return NULL;
+}
+
+/* Computes every checkpoint of the buffer at once, lexing it in chunks on
+ * all available cores and then stitching the chunks together in order.
+ */
+void editorSyntaxScanAll() {
+  if (E.syntax == NULL) return;
+
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > LV_MAX_THREADS) nthreads = LV_MAX_THREADS;
+  if (nthreads > E.numrows / LV_HL_MIN_CHUNK)
+    nthreads = E.numrows / LV_HL_MIN_CHUNK;
+  if (nthreads < 2) return;  // Small buffers are left to the lazy path
+
+  int nblocks = E.numrows / LV_HL_BLOCK + 1;
+  int per = (nblocks + nthreads - 1) / nthreads;
+  syntaxReserveCheckpoints(nblocks);
+
+  struct hlchunk chunks[LV_MAX_THREADS];
+  int n = 0;
+  for (int b = 0; b < nblocks; b += per, n++) {
+    struct hlchunk *c = &chunks[n];
+    c->from = b * LV_HL_BLOCK;
+    c->to = (b + per) * LV_HL_BLOCK;
+    if (c->to > E.numrows) c->to = E.numrows;
+    c->check[0] = malloc(per);
+    c->check[1] = malloc(per);
+    c->threaded = (pthread_create(&c->thread, NULL, syntaxChunkWorker, c) == 0);
+    if (!c->threaded) syntaxChunkWorker(c);
+  }
+
+  int state = 0;
+  E.hlcheck[0] = 0;
+  for (int i = 0; i < n; i++) {
+    struct hlchunk *c = &chunks[i];
+    if (c->threaded) pthread_join(c->thread, NULL);
+    int first = c->from / LV_HL_BLOCK;
+    memcpy(&E.hlcheck[first + 1], c->check[state],
+           (c->to - c->from) / LV_HL_BLOCK);
+    state = c->exit[state];
+    free(c->check[0]);
+    free(c->check[1]);
+  }
+  E.hlvalid = nblocks;
+}
+
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+    case HL_COMMENT:
+    case HL_ML_COMMENT: return 90;
     case HL_KEYWORD1: return 35;
     case HL_KEYWORD2: return 36;
     case HL_STRING: return 32;
@@ -396,8 +1574,8 @@ void editorSelectSyntaxHighlight() {
 
   char *ext = strrchr(E.filename, '.');
 
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
+  for (int j = 0; j < E.nsyntaxes; j++) {
+    struct editorSyntax *s = E.syntaxes[j];
     unsigned int i = 0;
     while (s->filematch[i]) {
       int is_ext = (s->filematch[i][0] == '.');
@@ -405,9 +1583,10 @@ void editorSelectSyntaxHighlight() {
           (!is_ext && strstr(E.filename, s->filematch[i]))) {
         E.syntax = s;
 
-        for (int filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.rows[filerow]);
-        }
+        // Every row gets highlighted again the next time it is rendered
+        while (E.lru_head) editorRenderCacheDrop(E.lru_head);
+        E.hlvalid = 1;
+        if (!E.loading) editorSyntaxScanAll();
 
         return;
       }
@@ -416,15 +1595,530 @@ void editorSelectSyntaxHighlight() {
   }
 }
 
+/*** syntax definitions ***/
+
+/*
+ * Besides the built-in HLDB, syntax definitions are read from the *.syntax
+ * files in $LV_SYNTAX_DIR (default ~/.config/lv/syntax). Each line of a
+ * definition is a key followed by its values:
+ *
+ *   filetype python
+ *   filematch .py SConstruct
+ *   keywords if elif else for while def return
+ *   types int str float
+ *   comment #
+ *   multiline_comment """ """
+ *   highlight numbers strings
+ *
+ * Lines starting with '#' are ignored. The compiled tables of every
+ * definition are cached in $XDG_CACHE_HOME/lv/syntax.cache (default
+ * ~/.cache/lv) along with the name, inode, size and mtime of the file each
+ * came from, so definitions are only parsed again after one of them changes.
+ */
+
+#define LV_SYNTAX_CACHE_MAGIC 0x4c565343u  // "LVSC"
+#define LV_SYNTAX_CACHE_VERSION 3
+
+void editorSyntaxAdd(struct editorSyntax *syntax) {
+  E.syntaxes = realloc(E.syntaxes, sizeof(*E.syntaxes) * (E.nsyntaxes + 1));
+  E.syntaxes[E.nsyntaxes++] = syntax;
+}
+
+/* Appends to a NULL-terminated list of strings
+ */
+static void strlistPush(char ***list, int *len, char *s) {
+  *list = realloc(*list, sizeof(char *) * (*len + 2));
+  (*list)[(*len)++] = s;
+  (*list)[*len] = NULL;
+}
+
+static void strlistFree(char **list) {
+  for (int j = 0; list && list[j]; j++) free(list[j]);
+  free(list);
+}
+
+static void syntaxFree(struct editorSyntax *syntax) {
+  free(syntax->filetype);
+  strlistFree(syntax->filematch);
+  strlistFree(syntax->keywords);
+  free(syntax->singleline_comment_start);
+  free(syntax->multiline_comment_start);
+  free(syntax->multiline_comment_end);
+  if (syntax->table) free(syntax->table->slots);
+  free(syntax->table);
+  free(syntax);
+}
+
+/* Parses a definition file. Returns NULL if it can't be read or lacks a
+ * filetype or a filematch.
+ */
+static struct editorSyntax *syntaxParseFile(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) return NULL;
+
+  struct editorSyntax *syntax = calloc(1, sizeof(struct editorSyntax));
+  int nmatch = 0, nkeywords = 0;
+  strlistPush(&syntax->filematch, &nmatch, NULL);
+  strlistPush(&syntax->keywords, &nkeywords, NULL);
+  nmatch = nkeywords = 0;
+
+  char *line = NULL;
+  size_t linecap = 0;
+  while (getline(&line, &linecap, fp) != -1) {
+    const char *ws = " \t\r\n";
+    char *save;
+    char *key = strtok_r(line, ws, &save);
+    if (key == NULL || key[0] == '#') continue;
+
+    char *arg;
+    if (!strcmp(key, "filetype")) {
+      if ((arg = strtok_r(NULL, ws, &save))) {
+        free(syntax->filetype);
+        syntax->filetype = strdup(arg);
+      }
+    } else if (!strcmp(key, "filematch")) {
+      while ((arg = strtok_r(NULL, ws, &save)))
+        strlistPush(&syntax->filematch, &nmatch, strdup(arg));
+    } else if (!strcmp(key, "keywords") || !strcmp(key, "types")) {
+      int kw2 = !strcmp(key, "types");
+      while ((arg = strtok_r(NULL, ws, &save))) {
+        // Types are stored like the second class of HLDB keywords
+        char *word = malloc(strlen(arg) + 2);
+        sprintf(word, kw2 ? "%s|" : "%s", arg);
+        strlistPush(&syntax->keywords, &nkeywords, word);
+      }
+    } else if (!strcmp(key, "comment")) {
+      if ((arg = strtok_r(NULL, ws, &save))) {
+        free(syntax->singleline_comment_start);
+        syntax->singleline_comment_start = strdup(arg);
+      }
+    } else if (!strcmp(key, "multiline_comment")) {
+      char *start = strtok_r(NULL, ws, &save);
+      char *end = strtok_r(NULL, ws, &save);
+      if (start && end) {
+        free(syntax->multiline_comment_start);
+        free(syntax->multiline_comment_end);
+        syntax->multiline_comment_start = strdup(start);
+        syntax->multiline_comment_end = strdup(end);
+      }
+    } else if (!strcmp(key, "highlight")) {
+      while ((arg = strtok_r(NULL, ws, &save))) {
+        if (!strcmp(arg, "numbers")) syntax->flags |= HL_HIGHLIGHT_NUMBERS;
+        if (!strcmp(arg, "strings")) syntax->flags |= HL_HIGHLIGHT_STRINGS;
+      }
+    }
+  }
+  free(line);
+  fclose(fp);
+
+  if (syntax->filetype == NULL || nmatch == 0) {
+    syntaxFree(syntax);
+    return NULL;
+  }
+  return syntax;
+}
+
+/* A *.syntax file found in the config directory
+ */
+struct syntaxfile {
+  char *name;
+  uint64_t dev, ino;  // which file it is, as the directory may change too
+  uint64_t size;
+  int64_t mtime;      // in nanoseconds
+};
+
+static int syntaxFileCmp(const void *a, const void *b) {
+  return strcmp(((const struct syntaxfile *)a)->name,
+                ((const struct syntaxfile *)b)->name);
+}
+
+static void cachePutU32(FILE *fp, uint32_t v) {
+  fwrite(&v, sizeof(v), 1, fp);
+}
+
+static void cachePutStr(FILE *fp, const char *s) {
+  if (s == NULL) {
+    cachePutU32(fp, UINT32_MAX);
+    return;
+  }
+  uint32_t len = strlen(s);
+  cachePutU32(fp, len);
+  fwrite(s, 1, len, fp);
+}
+
+static void cachePutList(FILE *fp, char **list) {
+  uint32_t n = 0;
+  while (list[n]) n++;
+  cachePutU32(fp, n);
+  for (uint32_t j = 0; j < n; j++) cachePutStr(fp, list[j]);
+}
+
+/* The cache readers set *err instead of failing, so that a truncated or
+ * corrupt cache can be detected once at the end
+ */
+static uint32_t cacheGetU32(FILE *fp, int *err) {
+  uint32_t v = 0;
+  if (fread(&v, sizeof(v), 1, fp) != 1) *err = 1;
+  return v;
+}
+
+static char *cacheGetStr(FILE *fp, int *err) {
+  uint32_t len = cacheGetU32(fp, err);
+  if (*err || len == UINT32_MAX || len > (1 << 20)) return NULL;
+  char *s = malloc(len + 1);
+  if (fread(s, 1, len, fp) != len) *err = 1;
+  s[len] = '\0';
+  return s;
+}
+
+static char **cacheGetList(FILE *fp, int *err) {
+  char **list = NULL;
+  int len = 0;
+  strlistPush(&list, &len, NULL);
+  len = 0;
+  uint32_t n = cacheGetU32(fp, err);
+  for (uint32_t j = 0; j < n && !*err; j++)
+    strlistPush(&list, &len, cacheGetStr(fp, err));
+  return list;
+}
+
+static void syntaxCachePath(char *buf, size_t size, int dir) {
+  char *xdg = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  if (xdg && xdg[0])
+    snprintf(buf, size, "%s/lv%s", xdg, dir ? "" : "/syntax.cache");
+  else
+    snprintf(buf, size, "%s/.cache/lv%s", home ? home : ".",
+             dir ? "" : "/syntax.cache");
+}
+
+/* Writes the compiled definitions, in the same order as their files
+ */
+static void syntaxCacheWrite(struct syntaxfile *files,
+                             struct editorSyntax **syntaxes, int n) {
+  char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX + 8];
+  syntaxCachePath(dir, sizeof(dir), 1);
+  syntaxCachePath(path, sizeof(path), 0);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  // Create ~/.cache as well as ~/.cache/lv if need be
+  char *slash = strrchr(dir, '/');
+  if (slash) {
+    *slash = '\0';
+    mkdir(dir, 0755);
+    *slash = '/';
+  }
+  mkdir(dir, 0755);
+
+  FILE *fp = fopen(tmp, "wb");
+  if (!fp) return;
+
+  cachePutU32(fp, LV_SYNTAX_CACHE_MAGIC);
+  cachePutU32(fp, LV_SYNTAX_CACHE_VERSION);
+  cachePutU32(fp, n);
+  for (int j = 0; j < n; j++) {
+    struct editorSyntax *s = syntaxes[j];
+    struct syntaxTable *t = s->table;
+
+    cachePutStr(fp, files[j].name);
+    fwrite(&files[j].dev, sizeof(files[j].dev), 1, fp);
+    fwrite(&files[j].ino, sizeof(files[j].ino), 1, fp);
+    fwrite(&files[j].size, sizeof(files[j].size), 1, fp);
+    fwrite(&files[j].mtime, sizeof(files[j].mtime), 1, fp);
+
+    cachePutStr(fp, s->filetype);
+    cachePutList(fp, s->filematch);
+    cachePutList(fp, s->keywords);
+    cachePutStr(fp, s->singleline_comment_start);
+    cachePutStr(fp, s->multiline_comment_start);
+    cachePutStr(fp, s->multiline_comment_end);
+    cachePutU32(fp, s->flags);
+
+    fwrite(t->cclass, 1, sizeof(t->cclass), fp);
+    cachePutU32(fp, t->seed);
+    cachePutU32(fp, t->mask);
+    // Slots are stored as indexes into the keyword list
+    for (uint32_t k = 0; k <= t->mask; k++) {
+      uint32_t idx = UINT32_MAX;
+      for (uint32_t w = 0; t->slots[k].word && s->keywords[w]; w++) {
+        if (s->keywords[w] == t->slots[k].word) idx = w;
+      }
+      cachePutU32(fp, idx);
+    }
+  }
+
+  if (fclose(fp) == 0) rename(tmp, path);
+  else unlink(tmp);
+}
+
+/* Loads compiled definitions from the cache, provided it was written from
+ * exactly the given files. Returns 0 and fills syntaxes on success.
+ */
+static int syntaxCacheRead(struct syntaxfile *files,
+                           struct editorSyntax **syntaxes, int n) {
+  char path[PATH_MAX];
+  syntaxCachePath(path, sizeof(path), 0);
+  FILE *fp = fopen(path, "rb");
+  if (!fp) return -1;
+
+  int err = 0;
+  int loaded = 0;
+  if (cacheGetU32(fp, &err) != LV_SYNTAX_CACHE_MAGIC ||
+      cacheGetU32(fp, &err) != LV_SYNTAX_CACHE_VERSION ||
+      cacheGetU32(fp, &err) != (uint32_t)n)
+    err = 1;
+
+  while (!err && loaded < n) {
+    uint64_t dev, ino, size;
+    int64_t mtime;
+    char *name = cacheGetStr(fp, &err);
+    if (fread(&dev, sizeof(dev), 1, fp) != 1 ||
+        fread(&ino, sizeof(ino), 1, fp) != 1 ||
+        fread(&size, sizeof(size), 1, fp) != 1 ||
+        fread(&mtime, sizeof(mtime), 1, fp) != 1)
+      err = 1;
+    if (err || name == NULL || strcmp(name, files[loaded].name) ||
+        dev != files[loaded].dev || ino != files[loaded].ino ||
+        size != files[loaded].size || mtime != files[loaded].mtime) {
+      free(name);
+      err = 1;
+      break;
+    }
+    free(name);
+
+    struct editorSyntax *s = calloc(1, sizeof(struct editorSyntax));
+    struct syntaxTable *t = calloc(1, sizeof(struct syntaxTable));
+    s->table = t;
+    syntaxes[loaded++] = s;
+
+    s->filetype = cacheGetStr(fp, &err);
+    s->filematch = cacheGetList(fp, &err);
+    s->keywords = cacheGetList(fp, &err);
+    s->singleline_comment_start = cacheGetStr(fp, &err);
+    s->multiline_comment_start = cacheGetStr(fp, &err);
+    s->multiline_comment_end = cacheGetStr(fp, &err);
+    s->flags = cacheGetU32(fp, &err);
+
+    if (fread(t->cclass, 1, sizeof(t->cclass), fp) != sizeof(t->cclass))
+      err = 1;
+    t->seed = cacheGetU32(fp, &err);
+    t->mask = cacheGetU32(fp, &err);
+    if (err || t->mask > (1 << 20) || (t->mask & (t->mask + 1))) {
+      err = 1;
+      break;
+    }
+
+    int nkeywords = 0;
+    while (s->keywords[nkeywords]) nkeywords++;
+    t->slots = calloc(t->mask + 1, sizeof(struct kwslot));
+    for (uint32_t k = 0; k <= t->mask && !err; k++) {
+      uint32_t idx = cacheGetU32(fp, &err);
+      if (idx == UINT32_MAX) continue;
+      if (idx >= (uint32_t)nkeywords) {
+        err = 1;
+        break;
+      }
+      const char *word = s->keywords[idx];
+      int len = strlen(word);
+      int kw2 = len && word[len - 1] == '|';
+      t->slots[k].word = word;
+      t->slots[k].len = kw2 ? len - 1 : len;
+      t->slots[k].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    }
+
+    char *scs = s->singleline_comment_start;
+    char *mcs = s->multiline_comment_start;
+    char *mce = s->multiline_comment_end;
+    t->scs_len = scs ? strlen(scs) : 0;
+    t->mcs_len = mcs ? strlen(mcs) : 0;
+    t->mce_len = mce ? strlen(mce) : 0;
+  }
+  fclose(fp);
+
+  if (err) {
+    for (int j = 0; j < loaded; j++) syntaxFree(syntaxes[j]);
+    return -1;
+  }
+  return 0;
+}
+
+/* Adds the definitions from the config directory to E.syntaxes, from the
+ * cache if it is current and by parsing and compiling the files otherwise
+ */
+void editorSyntaxLoad() {
+  char dirpath[PATH_MAX];
+  char *env = getenv("LV_SYNTAX_DIR");
+  char *home = getenv("HOME");
+  if (env && env[0])
+    snprintf(dirpath, sizeof(dirpath), "%s", env);
+  else
+    snprintf(dirpath, sizeof(dirpath), "%s/.config/lv/syntax",
+             home ? home : ".");
+
+  DIR *dir = opendir(dirpath);
+  if (!dir) return;
+
+  struct syntaxfile *files = NULL;
+  int n = 0;
+  struct dirent *de;
+  while ((de = readdir(dir))) {
+    size_t len = strlen(de->d_name);
+    if (len <= 7 || strcmp(&de->d_name[len - 7], ".syntax")) continue;
+
+    char path[PATH_MAX + 256];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dirpath, de->d_name);
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) continue;
+
+    files = realloc(files, sizeof(struct syntaxfile) * (n + 1));
+    files[n].name = strdup(de->d_name);
+    files[n].dev = st.st_dev;
+    files[n].ino = st.st_ino;
+    files[n].size = st.st_size;
+    files[n].mtime =
+        (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    n++;
+  }
+  closedir(dir);
+  qsort(files, n, sizeof(struct syntaxfile), syntaxFileCmp);
+
+  struct editorSyntax **syntaxes = malloc(sizeof(*syntaxes) * (n + 1));
+  if (n > 0 && syntaxCacheRead(files, syntaxes, n) == 0) {
+    for (int j = 0; j < n; j++) editorSyntaxAdd(syntaxes[j]);
+  } else if (n > 0) {
+    // The cache is only written when every file could be parsed, since it
+    // has to describe the whole directory
+    int ok = 1;
+    for (int j = 0; j < n; j++) {
+      char path[PATH_MAX + 256];
+      snprintf(path, sizeof(path), "%s/%s", dirpath, files[j].name);
+      syntaxes[j] = syntaxParseFile(path);
+      if (syntaxes[j] == NULL) {
+        ok = 0;
+        continue;
+      }
+      editorSyntaxCompile(syntaxes[j]);
+      editorSyntaxAdd(syntaxes[j]);
+    }
+    if (ok) syntaxCacheWrite(files, syntaxes, n);
+  }
+
+  for (int j = 0; j < n; j++) free(files[j].name);
+  free(files);
+  free(syntaxes);
+}
+
+/*** render cache ***/
+
+/*
+ * render and hl are derived from chars and only exist for rows that have
+ * been drawn or searched recently. Those rows are kept on an LRU list, and
+ * once their combined size goes over E.renderbudget the least recently used
+ * ones that are well away from the viewport drop their render and hl again.
+ */
+
+static size_t renderCacheCost(erow *row) {
+  return 2 * row->rsize + 1;
+}
+
+static void renderCacheUnlink(erow *row) {
+  if (row->lru_prev) row->lru_prev->lru_next = row->lru_next;
+  else E.lru_head = row->lru_next;
+  if (row->lru_next) row->lru_next->lru_prev = row->lru_prev;
+  else E.lru_tail = row->lru_prev;
+  row->lru_prev = row->lru_next = NULL;
+}
+
+static void renderCachePushFront(erow *row) {
+  row->lru_prev = NULL;
+  row->lru_next = E.lru_head;
+  if (E.lru_head) E.lru_head->lru_prev = row;
+  else E.lru_tail = row;
+  E.lru_head = row;
+}
+
+/* Drops the render and hl of a row, keeping its comment state
+ */
+void editorRenderCacheDrop(erow *row) {
+  if (row->render == NULL) return;
+  renderCacheUnlink(row);
+  E.rendermem -= renderCacheCost(row);
+  free(row->render);
+  free(row->hl);
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_state = -1;
+  row->rsize = 0;
+}
+
+/* Evicts least recently used rows until the cache fits its budget. Rows
+ * within a screen of the viewport are stepped over rather than evicted, as
+ * is the row used last, which its caller is still holding.
+ */
+void editorRenderCacheTrim() {
+  erow *row = E.lru_tail;
+  while (E.rendermem > E.renderbudget && row && row != E.lru_head) {
+    erow *prev = row->lru_prev;
+    int at = editorRowIndex(row);
+    if (at < E.rowoff - E.screenrows || at >= E.rowoff + 2 * E.screenrows)
+      editorRenderCacheDrop(row);
+    row = prev;
+  }
+}
+
+/* Makes sure a row has its render, building it if needed
+ */
+void editorRowRender(erow *row) {
+  if (row->render) {
+    if (row != E.lru_head) {
+      renderCacheUnlink(row);
+      renderCachePushFront(row);
+    }
+    return;
+  }
+
+  int tabs = 0;
+  for (int j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t') tabs++;
+  }
+
+  row->render = malloc(row->size + (tabs*KILO_TAB_STOP) + 1);
+
+  int idx = 0;
+  for (int j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t') {
+      row->render[idx++] = ' ';
+      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+    } else {
+      row->render[idx++] = row->chars[j];
+    }
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+
+  E.rendermem += renderCacheCost(row);
+  renderCachePushFront(row);
+  editorRenderCacheTrim();
+}
+
+/* Makes sure a row has its render and an hl lexed from the given comment
+ * state. Returns the comment state at the end of the row.
+ */
+int editorRowHighlight(erow *row, int in_comment) {
+  editorRowRender(row);
+  if (row->hl_state != in_comment) editorUpdateSyntax(row, in_comment);
+  return row->hl_open_comment;
+}
+
 /*** row operation ***/
 
 /* Updates the rx and ry coords
  * Counts tab spaces and sets rx accordingly
  */
 void editorUpdateRenderCoords() {
-  erow *row = &E.rows[E.cy];
+  erow *row = editorRowAt(E.cy);
   int rx = E.lncolwidth - 1;
-  for (int j = 0; j < E.cx; j++) {
+  for (int j = 0; row && j < E.cx; j++) {
     if (row->chars[j] == '\t') {
       rx += (KILO_TAB_STOP - 1);
       rx -= (rx % KILO_TAB_STOP);
@@ -438,10 +2132,10 @@ void editorUpdateRenderCoords() {
 /* Updates the cx and cy coords according to rx and ry values
  */
 void editorUpdateDataCoords() {
-  erow *row = &E.rows[E.ry];
+  erow *row = editorRowAt(E.ry);
   int rx = E.lncolwidth - 1;
   int j;
-  for (j = 0; j < row->size; j++) {
+  for (j = 0; row && j < row->size; j++) {
     if (row->chars[j] == '\t') {
       rx += KILO_TAB_STOP - 1;
       rx -= (rx % KILO_TAB_STOP);
@@ -461,30 +2155,51 @@ void editorUpdateDataCoords() {
   E.cy = E.ry;  // TODO - will break with line wrapping
 }
 
-/* Updates the render row for the given erow
+/* Walks the render column *rx of chars offset *cx forward to offset `to`
+ * and returns it
  */
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') tabs++;
+int editorRowCxToRx(erow *row, int *cx, int *rx, int to) {
+  for (; *cx < to && *cx < row->size; (*cx)++) {
+    if (row->chars[*cx] == '\t') *rx = (*rx / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+    else (*rx)++;
   }
+  return *rx;
+}
 
-  free(row->render);
-  row->render = malloc(row->size + (tabs*KILO_TAB_STOP) + 1);
-
-  int idx = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
-    }
-  }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+/* Must be called whenever the chars of a row change. Its render and hl are
+ * rebuilt the next time they are needed.
+ */
+void editorUpdateRow(erow *row) {
+  editorRenderCacheDrop(row);
+  editorSyntaxInvalidate(editorRowIndex(row));
+  editorSearchStop();
+  E.sh_marked = 0;
+}
 
-  editorUpdateSyntax(row);
+/* Returns a new node, not linked into the tree yet, holding a row with a
+ * copy of the given string
+ */
+static rownode *editorNewRow(const char *s, size_t len) {
+  rownode *n = malloc(sizeof(rownode));
+  n->left = n->right = n->parent = NULL;
+  n->prio = rowTreeRand();
+  n->span = 0;
+  rowTreePull(n);
+
+  erow *row = &n->row;
+  row->size = len;
+  row->chars = malloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->owned = 1;
+
+  row->rsize = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_state = -1;
+  row->hl_open_comment = 0;
+  row->lru_prev = row->lru_next = NULL;
+  return n;
 }
 
 /* Appends a row onto erow using the given string
@@ -493,289 +2208,2628 @@ void editorUpdateRow(erow *row) {
 void editorInsertRow(int at, char *s, size_t len) {
   if (at < 0 || at > E.numrows) return; 
 
-  E.rows = realloc(E.rows, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.rows[at+1], &E.rows[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++) E.rows[j].idx++;
+  rownode *n = editorNewRow(s, len);
+  rowTreeInsert(at, n);
+  editorUpdateRow(&n->row);
+  editorUndoRecord(UNDO_INSERT, at, 0, s, len, 1);
 
-  E.rows[at].idx = at;
+  E.numrows++;
+  E.dirty++;
+}
 
-  E.rows[at].size = len;
-  E.rows[at].chars = malloc(len + 1);
-  memcpy(E.rows[at].chars, s, len);
-  E.rows[at].chars[len] = '\0';
+void editorFreeRow(erow *row) {
+  if (row->owned) free(row->chars);
+  editorRenderCacheDrop(row);
+}
 
-  E.rows[at].linecol = malloc(E.lncolwidth + 1); // TODO - this should prob be max num of digits for int
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows) return;
+  editorSyntaxInvalidate(at);
+  editorSearchStop();
+  E.sh_marked = 0;
+  rownode *n = rowTreeRemove(at);
+  int len = n->row.size;
+  char *chars = n->span ? editorMapLine(n->line, &len) : n->row.chars;
+  editorUndoRecord(UNDO_DELETE, at, 0, chars, len, 1);
+  if (!n->span) editorFreeRow(&n->row);
+  free(n);
+  E.numrows--;
+  E.dirty++;
+}
 
-  E.rows[at].rsize = 0;
-  E.rows[at].render = NULL;
-  E.rows[at].hl = NULL;
-  E.rows[at].hl_open_comment = 0;
-  editorUpdateRow(&E.rows[at]);
+/* Copies a row that still views the file mapping into storage of its own,
+ * so that it can be edited
+ */
+void editorRowOwn(erow *row) {
+  if (row->owned) return;
+  char *chars = malloc(row->size + 1);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  row->chars = chars;
+  row->owned = 1;
+}
 
-  E.numrows++;
+/*
+ * Attempts to insert a new char into the given row
+ */
+void editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row->size) at = row->size;
+  char ch = c;
+  editorUndoRecord(UNDO_INSERT, editorRowIndex(row), at, &ch, 1, 0);
+  editorRowOwn(row);
+  row->chars = realloc(row->chars, row->size + 2);
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  row->size++;
+  row->chars[at] = c;
+  editorUpdateRow(row);
   E.dirty++;
 }
 
-void editorFreeRow(erow *row) {
-  free(row->chars);
-  free(row->render);
-  free(row->linecol);
-  free(row->hl);
+void editorInsertNewline() {
+  editorLoadTail();
+  if (E.cx == 0)
+    editorInsertRow(E.cy, "", 0);
+  else {
+    erow *row = editorRowAt(E.cy);
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    editorUndoRecord(UNDO_DELETE, E.cy, E.cx, &row->chars[E.cx],
+                     row->size - E.cx, 0);
+    editorRowOwn(row);
+    row->size = E.cx;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorUndoRecord(UNDO_INSERT, editorRowIndex(row), row->size, s, len, 0);
+  editorRowOwn(row);
+  row->chars = realloc(row->chars, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/*
+ * Attempts to remove a char from a given row
+ */
+void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at > row->size) return;
+  editorUndoRecord(UNDO_DELETE, editorRowIndex(row), at, &row->chars[at], 1,
+                   0);
+  editorRowOwn(row);
+  memmove(&row->chars[at], &row->chars[at+1], row->size - at);
+  row->size--;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/*** editor operations ***/
+
+/* Lines past the ones loaded so far are still to come, so the end of the
+ * buffer is only known, and edited, once loading is done. The cursor stays
+ * at the end.
+ */
+void editorLoadTail() {
+  if (!E.loading || E.cy != E.numrows) return;
+  editorLoadWait(INT_MAX);
+  E.cy = E.numrows;
+  E.cx = 0;
+}
+
+void editorInsertChar(int c) {
+  editorLoadTail();
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+  E.cx++;
+}
+
+/* Returns the offset of the first line ending in s[from, len), or len. A
+ * '\r' only ends a line if cr is set.
+ */
+static size_t editorTextLineEnd(const char *s, size_t from, size_t len,
+                                int cr) {
+  while (from < len && s[from] != '\n' && !(cr && s[from] == '\r')) from++;
+  return from;
+}
+
+/* Inserts text at the cursor and leaves the cursor after it. Lines end in
+ * \n, or also in \r and \r\n if cr is set. The new rows are built into a
+ * tree of their own and linked in with a single split, so the whole text
+ * costs one pass instead of an edit per character.
+ */
+static void editorSpliceText(const char *s, size_t len, int cr) {
+  if (len == 0) return;
+  editorLoadTail();
+  if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+  erow *row = editorRowAt(E.cy);
+  editorRowOwn(row);
+
+  // The part of the row after the cursor ends up after the text
+  int tail = row->size - E.cx;
+  char *rest = malloc(tail + 1);
+  memcpy(rest, &row->chars[E.cx], tail);
+
+  size_t end = editorTextLineEnd(s, 0, len, cr);
+  row->chars = realloc(row->chars, E.cx + end + 1);
+  memcpy(&row->chars[E.cx], s, end);
+  row->size = E.cx + end;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+
+  rownode *t = NULL, *last = NULL;
+  int count = 0;
+  for (size_t at = end; at < len; at = end) {
+    at += (cr && s[at] == '\r' && at + 1 < len && s[at + 1] == '\n') ? 2 : 1;
+    end = editorTextLineEnd(s, at, len, cr);
+    last = editorNewRow(&s[at], end - at);
+    t = rowTreeMerge(t, last);
+    count++;
+  }
+
+  erow *dst = count ? &last->row : row;
+  E.cx = dst->size;
+  dst->chars = realloc(dst->chars, dst->size + tail + 1);
+  memcpy(&dst->chars[dst->size], rest, tail);
+  dst->size += tail;
+  dst->chars[dst->size] = '\0';
+  free(rest);
+
+  // Invalidating from the edited row above covers the rows linked in here
+  if (count) {
+    rowTreeInsertTree(E.cy + 1, t);
+    E.numrows += count;
+    E.cy += count;
+  }
+  E.dirty++;
+}
+
+/* Inserts text whose lines may end in \r, \n or \r\n at the cursor, and
+ * records it for undo as a single op
+ */
+void editorInsertText(const char *s, size_t len) {
+  // The cursor may still move to the end of a file being loaded
+  editorLoadTail();
+  int y = E.cy, x = E.cx;
+  editorSpliceText(s, len, 1);
+
+  // The log only knows \n as a line ending
+  char *text = NULL;
+  size_t n = len;
+  if (memchr(s, '\r', len)) {
+    text = malloc(len);
+    n = 0;
+    for (size_t j = 0; j < len; j++) {
+      if (s[j] == '\r' && j + 1 < len && s[j + 1] == '\n') j++;
+      text[n++] = s[j] == '\r' ? '\n' : s[j];
+    }
+  }
+  editorUndoRecord(UNDO_INSERT, y, x, text ? text : s, n, 0);
+  free(text);
+}
+
+/* Deletes the text from (x, y) up to (ex, ey), where the end of a row counts
+ * as a character. The rows in between are unlinked with two splits, so the
+ * whole text costs about as much as a single row.
+ */
+void editorDeleteText(int y, int x, int ey, int ex) {
+  if (ey == y) {
+    erow *row = editorRowAt(y);
+    editorRowOwn(row);
+    memmove(&row->chars[x], &row->chars[ex], row->size - ex + 1);
+    row->size -= ex - x;
+    editorUpdateRow(row);
+    E.dirty++;
+    return;
+  }
+
+  editorSyntaxInvalidate(y);
+  editorSearchStop();
+  E.sh_marked = 0;
+  if (x > 0 || ex > 0) {
+    // What is left of the last row moves up to the end of the first one
+    erow *row = editorRowAt(y);
+    erow *last = ey < E.numrows ? editorRowAt(ey) : NULL;
+    int tail = last ? last->size - ex : 0;
+    editorRowOwn(row);
+    row->chars = realloc(row->chars, x + tail + 1);
+    if (tail) memcpy(&row->chars[x], &last->chars[ex], tail);
+    row->size = x + tail;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    y++;
+    if (last) ey++;
+  }
+  rowTreeFree(rowTreeRemoveRange(y, ey - y));
+  E.numrows -= ey - y;
+  E.dirty++;
+}
+
+/* Inserts text whose lines end in \n at (x, y) and leaves the cursor after
+ * it. Text past the last row always ends in the '\n' of a row of its own.
+ */
+void editorInsertTextAt(int y, int x, const char *s, size_t len) {
+  E.cy = y;
+  E.cx = x;
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+    len--;
+  }
+  editorSpliceText(s, len, 0);
+}
+
+void editorDeleteChar() {
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+
+  erow *row = editorRowAt(E.cy);
+  if (E.cx > 0) {
+    editorRowDelChar(row, E.cx - 1);
+    E.cx--;
+  } else {
+    erow *prev = editorRowPrev(row);
+    E.cx = prev->size;
+    editorRowAppendString(prev, row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+/*** undo ***/
+
+/*
+ * Every edit is recorded as the text it inserts or deletes at a position,
+ * with the end of a row counting as a '\n'. Ops go to an append-only log
+ * whose text lives in fixed-size chunks; once the chunks take more than
+ * the undo budget, the oldest ones are written to an unlinked temporary
+ * file and read back from there when needed. Typing or deleting characters
+ * one after the other on a row extends the last op instead of adding one,
+ * and the ops recorded for one key are undone and redone together. An op
+ * is applied with a single splice whatever its size.
+ */
+
+/* Opens the unlinked file the oldest text of the log is moved to
+ */
+static int undoSpillFile() {
+  const char *dir = getenv("TMPDIR");
+  if (dir == NULL || *dir == '\0') dir = "/tmp";
+  char *path = malloc(strlen(dir) + 16);
+  sprintf(path, "%s/lvundoXXXXXX", dir);
+  int fd = mkstemp(path);
+  if (fd != -1) unlink(path);
+  free(path);
+  return fd;
+}
+
+/* Drops the oldest ops, up to the first one whose text starts at or after
+ * `to`. A group is dropped as a whole. The chunks left with no text of any
+ * op are freed, and their space in the spill file is given back.
+ */
+static void undoForget(struct undolog *u, off_t to) {
+  int n = 0;
+  while (n < u->nops && (u->ops[n].off < to || !u->ops[n].group)) n++;
+  memmove(u->ops, &u->ops[n], sizeof(struct undoop) * (u->nops - n));
+  u->nops -= n;
+  u->pos = u->pos > n ? u->pos - n : 0;
+
+  int dead = (u->nops ? u->ops[0].off : u->end) / LV_UNDO_CHUNK;
+  if (dead <= u->dropped) return;
+  for (int i = u->dropped; i < dead; i++) {
+    if (u->chunks[i]) u->resident--;
+    free(u->chunks[i]);
+    u->chunks[i] = NULL;
+  }
+#ifdef __linux__
+  if (u->fd != -1)
+    fallocate(u->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              (off_t)u->dropped * LV_UNDO_CHUNK,
+              (off_t)(dead - u->dropped) * LV_UNDO_CHUNK);
+#endif
+  u->dropped = dead;
+  if (u->disk < dead) u->disk = dead;
+}
+
+/* Moves the oldest chunk still in memory to the spill file. If that can't
+ * be done, the history it holds is forgotten instead. Returns -1 if every
+ * chunk but the one being appended to is out of memory already.
+ */
+static int undoSpill(struct undolog *u) {
+  int last = u->end / LV_UNDO_CHUNK;
+  while (u->disk < last && u->chunks[u->disk] == NULL) u->disk++;
+  if (u->disk >= last) return -1;
+
+  int i = u->disk;
+  off_t at = (off_t)i * LV_UNDO_CHUNK;
+  if (u->fd == -1) u->fd = undoSpillFile();
+  if (u->fd == -1 ||
+      pwrite(u->fd, u->chunks[i], LV_UNDO_CHUNK, at) != LV_UNDO_CHUNK)
+    undoForget(u, at + LV_UNDO_CHUNK);
+  free(u->chunks[i]);
+  u->chunks[i] = NULL;
+  u->resident--;
+  u->disk++;
+  return 0;
+}
+
+static void undoAppend(struct undolog *u, const char *s, size_t len) {
+  while (len > 0) {
+    int i = u->end / LV_UNDO_CHUNK;
+    size_t at = u->end % LV_UNDO_CHUNK;
+    if (i == u->nchunks) {
+      u->chunks = realloc(u->chunks, sizeof(char *) * (i + 1));
+      u->chunks[u->nchunks++] = NULL;
+    }
+    if (u->chunks[i] == NULL) {
+      // After redo history is dropped, a spilled chunk may be appended to
+      u->chunks[i] = malloc(LV_UNDO_CHUNK);
+      u->resident++;
+      if (i < u->disk) u->disk = i;
+      if (at && (u->fd == -1 ||
+                 pread(u->fd, u->chunks[i], at, (off_t)i * LV_UNDO_CHUNK) !=
+                 (ssize_t)at))
+        undoForget(u, u->end);
+    }
+    size_t n = LV_UNDO_CHUNK - at;
+    if (n > len) n = len;
+    memcpy(&u->chunks[i][at], s, n);
+    u->end += n;
+    s += n;
+    len -= n;
+  }
+}
+
+static void undoRead(struct undolog *u, off_t off, size_t len, char *buf) {
+  while (len > 0) {
+    int i = off / LV_UNDO_CHUNK;
+    size_t at = off % LV_UNDO_CHUNK;
+    size_t n = LV_UNDO_CHUNK - at;
+    if (n > len) n = len;
+    if (u->chunks[i]) memcpy(buf, &u->chunks[i][at], n);
+    else if (pread(u->fd, buf, n, off) != (ssize_t)n) memset(buf, 0, n);
+    buf += n;
+    off += n;
+    len -= n;
+  }
+}
+
+/* Drops the ops that were undone, as they can't be redone once the buffer
+ * has been edited
+ */
+static void undoTruncate(struct undolog *u) {
+  u->end = u->ops[u->pos].off;
+  u->nops = u->pos;
+  int keep = u->end / LV_UNDO_CHUNK + 1;
+  for (int i = keep; i < u->nchunks; i++) {
+    if (u->chunks[i]) u->resident--;
+    free(u->chunks[i]);
+  }
+  if (u->nchunks > keep) u->nchunks = keep;
+  // Nothing past the chunk being appended to is read from the spill file
+  if (u->fd != -1) ftruncate(u->fd, (off_t)keep * LV_UNDO_CHUNK);
+}
+
+/* Tries to extend the last op with a single character typed or deleted
+ * right next to it. Returns 1 if it did.
+ */
+static int undoExtend(struct undolog *u, int type, int y, int x,
+                      const char *s, size_t len, int eol) {
+  if (u->nops == 0 || len != 1 || eol || *s == '\n') return 0;
+  struct undoop *op = &u->ops[u->nops - 1];
+  if (op->type != type || op->tick < u->tick - 1 || op->ey != op->y ||
+      op->y != y || op->off + (off_t)op->len != u->end)
+    return 0;
+
+  if (type == UNDO_INSERT && op->ex == x) {
+    op->ex++;
+  } else if (type == UNDO_DELETE && op->x == x && !op->reversed) {
+    op->ex++;
+  } else if (type == UNDO_DELETE && op->x == x + 1 &&
+             (op->reversed || op->len == 1)) {
+    // Backspacing: the text is kept back to front until it is read
+    op->reversed = 1;
+    op->x--;
+  } else {
+    return 0;
+  }
+  op->len++;
+  op->tick = u->tick;
+  undoAppend(u, s, 1);
+  return 1;
+}
+
+/* Records that the text s, followed by a '\n' if eol is set, was inserted
+ * at or deleted from row y, column x
+ */
+void editorUndoRecord(int type, int y, int x, const char *s, size_t len,
+                      int eol) {
+  struct undolog *u = &E.undo;
+  if (u->suspended || (len == 0 && !eol)) return;
+  if (u->pos < u->nops) undoTruncate(u);
+
+  // Where the text ends, for deleting it again
+  int ey = y;
+  const char *last = s;
+  for (const char *p = s; (p = memchr(p, '\n', s + len - p)); last = ++p)
+    ey++;
+  int ex = (ey == y ? x : 0) + (s + len - last);
+  if (eol) {
+    ey++;
+    ex = 0;
+  }
+  editorJournalRecord(type, y, x, ey, ex, s, len, eol);
+
+  if (!undoExtend(u, type, y, x, s, len, eol)) {
+    if (u->nops == LV_UNDO_MAX_OPS)
+      undoForget(u, u->ops[LV_UNDO_MAX_OPS / 4].off);
+    if (u->nops == u->cap) {
+      u->cap = u->cap ? u->cap * 2 : 64;
+      u->ops = realloc(u->ops, sizeof(struct undoop) * u->cap);
+    }
+    struct undoop *op = &u->ops[u->nops++];
+    op->type = type;
+    op->group = !u->open;
+    op->reversed = 0;
+    op->y = y;
+    op->x = x;
+    op->ey = ey;
+    op->ex = ex;
+    op->off = u->end;
+    op->len = len + eol;
+    op->tick = u->tick;
+    undoAppend(u, s, len);
+    if (eol) undoAppend(u, "\n", 1);
+  }
+  u->open = 1;
+  u->pos = u->nops;
+
+  while ((size_t)u->resident * LV_UNDO_CHUNK > u->budget && undoSpill(u) == 0);
+}
+
+/* Starts a new group: ops recorded from now on are undone separately from
+ * the ones before, unless they extend the last op
+ */
+void editorUndoBoundary() {
+  E.undo.tick++;
+  E.undo.open = 0;
+}
+
+/* Inserts the text of an op back, or deletes it again, leaving the cursor
+ * where the edit happened. Either is journaled like any other edit.
+ */
+static void undoApply(struct undolog *u, struct undoop *op, int insert) {
+  if (!insert) {
+    editorJournalRecord(UNDO_DELETE, op->y, op->x, op->ey, op->ex, NULL, 0, 0);
+    editorDeleteText(op->y, op->x, op->ey, op->ex);
+    E.cy = op->y;
+    E.cx = op->x;
+    return;
+  }
+
+  char *text = malloc(op->len + 1);
+  undoRead(u, op->off, op->len, text);
+  if (op->reversed) {
+    for (size_t i = 0, j = op->len - 1; i < j; i++, j--) {
+      char c = text[i];
+      text[i] = text[j];
+      text[j] = c;
+    }
+  }
+  editorJournalRecord(UNDO_INSERT, op->y, op->x, op->ey, op->ex, text,
+                      op->len, 0);
+  editorInsertTextAt(op->y, op->x, text, op->len);
+  free(text);
+}
+
+void editorUndo() {
+  struct undolog *u = &E.undo;
+  if (u->pos == 0) {
+    editorSetStatusMessage("Already at oldest change");
+    return;
+  }
+  u->suspended++;
+  struct undoop *op;
+  do {
+    op = &u->ops[--u->pos];
+    undoApply(u, op, op->type == UNDO_DELETE);
+  } while (!op->group && u->pos > 0);
+  u->suspended--;
+}
+
+void editorRedo() {
+  struct undolog *u = &E.undo;
+  if (u->pos == u->nops) {
+    editorSetStatusMessage("Already at newest change");
+    return;
+  }
+  u->suspended++;
+  do {
+    struct undoop *op = &u->ops[u->pos++];
+    undoApply(u, op, op->type == UNDO_INSERT);
+  } while (u->pos < u->nops && !u->ops[u->pos].group);
+  u->suspended--;
+}
+
+/*** journal ***/
+
+/*
+ * Edits not saved yet are appended to a journal next to the file, so that
+ * they can be replayed after a crash or a lost terminal. Ops are those of
+ * the undo log, with deletions kept as the range they removed. They are
+ * batched in memory, where typing and deleting characters one after the
+ * other extend the last op, and written out and synced every
+ * LV_JOURNAL_SYNC_MS. A save leaves only the ops made after its snapshot.
+ */
+
+static unsigned int journalHash(const char *s, size_t len) {
+  unsigned int h = 2166136261u;
+  for (size_t j = 0; j < len; j++) h = syntaxHash(h, s[j]);
+  return h;
+}
+
+/* Describes the file on disk, which a journal only applies to as long as
+ * it doesn't change
+ */
+static void journalHead(struct journalhead *head) {
+  struct stat st;
+  memset(head, 0, sizeof(*head));
+  head->magic = LV_JOURNAL_MAGIC;
+  head->version = LV_JOURNAL_VERSION;
+  if (stat(E.filename, &st) == 0) {
+    head->size = st.st_size;
+    head->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    head->ino = st.st_ino;
+  }
+}
+
+/* Returns the path of the journal of the file: ".name.lvswp" in the
+ * directory the file really is in
+ */
+static char *journalPath() {
+  char *target = realpath(E.filename, NULL);
+  if (target == NULL) target = strdup(E.filename);
+  char *slash = strrchr(target, '/');
+  char *base = slash ? slash + 1 : target;
+  char *path = malloc(strlen(target) + 8);
+  sprintf(path, "%.*s.%s.lvswp", (int)(base - target), target, base);
+  free(target);
+  return path;
+}
+
+static int journalWriteAll(int fd, const char *s, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, s, len);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    s += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Gives up on the journal when it can't be written
+ */
+static void journalFail(struct journal *j) {
+  editorSetStatusMessage("Can't write swap journal: %s", strerror(errno));
+  if (j->fd != -1) close(j->fd);
+  j->fd = -1;
+  j->failed = 1;
+  j->unsynced = 0;
+  j->pending.len = 0;
+  j->last = -1;
+}
+
+/* Takes the lock that keeps a journal to one lv at a time. If another lv
+ * editing the file holds it, the journal is left alone and nothing is
+ * journaled here. File systems without locks get no say.
+ */
+static int journalLock(struct journal *j, int fd) {
+  if (flock(fd, LOCK_EX | LOCK_NB) == 0 || errno != EWOULDBLOCK) return 0;
+  editorSetStatusMessage("%s is in use by another lv, edits aren't journaled",
+                         j->path);
+  close(fd);
+  j->failed = 1;
+  return -1;
+}
+
+/* Moves a journal that can't be replayed out of the way to "<journal>.old",
+ * so that it is kept rather than overwritten
+ */
+static void journalSetAside(struct journal *j, const char *why) {
+  char *old = malloc(strlen(j->path) + 5);
+  sprintf(old, "%s.old", j->path);
+  if (rename(j->path, old) == 0)
+    editorSetStatusMessage("Moved %s to %s: %s", j->path, old, why);
+  free(old);
+}
+
+/* Opens a new journal. One found there already was left by a session that
+ * ended after this one started, and is moved aside instead of truncated.
+ */
+static int journalCreate(struct journal *j) {
+  if (j->path == NULL) j->path = journalPath();
+  int fd = open(j->path, O_RDWR | O_CREAT, 0600);
+  if (fd == -1) return -1;
+  if (journalLock(j, fd) == -1) return -1;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    journalSetAside(j, "it was never recovered");
+    close(fd);
+    fd = open(j->path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) return -1;
+    if (journalLock(j, fd) == -1) return -1;
+  }
+  return fd;
+}
+
+/* Writes out the ops batched so far, creating the journal on the first
+ * one. They are only synced later.
+ */
+static int journalWrite(struct journal *j, const char *s, size_t len) {
+  if (j->failed) return -1;
+  if (j->fd == -1) {
+    j->fd = journalCreate(j);
+    if (j->failed) return -1;
+    struct journalhead head;
+    journalHead(&head);
+    if (j->fd == -1 || journalWriteAll(j->fd, (char *)&head, sizeof(head))) {
+      journalFail(j);
+      return -1;
+    }
+    j->size = sizeof(head);
+  }
+  if (journalWriteAll(j->fd, s, len) == -1) {
+    journalFail(j);
+    return -1;
+  }
+  j->size += len;
+  j->unsynced = 1;
+  return 0;
+}
+
+static void journalFlush(struct journal *j) {
+  if (j->pending.len) journalWrite(j, j->pending.b, j->pending.len);
+  j->pending.len = 0;
+  j->last = -1;
+}
+
+/* Tries to extend the last op batched with a single character typed or
+ * deleted right next to it. Returns 1 if it did.
+ */
+static int journalExtend(struct journal *j, int type, int y, int x,
+                         const char *s, size_t len, int eol) {
+  if (j->last == -1 || len != 1 || eol || *s == '\n') return 0;
+  struct journalop op;
+  memcpy(&op, &j->pending.b[j->last], sizeof(op));
+  if ((int)op.type != type || op.y != op.ey || op.y != y) return 0;
+
+  if (type == UNDO_INSERT && op.ex == x) {
+    op.ex++;
+    op.len++;
+    op.sum = syntaxHash(op.sum, *s);
+    abAppend(&j->pending, s, 1);
+  } else if (type == UNDO_DELETE && op.x == x) {
+    op.ex++;
+  } else if (type == UNDO_DELETE && op.x == x + 1) {
+    op.x--;
+  } else {
+    return 0;
+  }
+  memcpy(&j->pending.b[j->last], &op, sizeof(op));
+  return 1;
+}
+
+/* Adds an op to the journal: text inserted at (x, y) that ends at (ex, ey),
+ * followed by a '\n' if eol is set, or the text from (x, y) up to (ex, ey)
+ * deleted
+ */
+void editorJournalRecord(int type, int y, int x, int ey, int ex,
+                         const char *s, size_t len, int eol) {
+  struct journal *j = &E.journal;
+  if (E.filename == NULL || j->failed) return;
+  if (journalExtend(j, type, y, x, s, len, eol)) return;
+  // A deletion is kept as its range only
+  if (type == UNDO_DELETE) len = eol = 0;
+
+  struct journalop op = {type, y, x, ey, ex, journalHash(s, len), len + eol};
+  if (eol) op.sum = syntaxHash(op.sum, '\n');
+  if (sizeof(op) + op.len > LV_JOURNAL_BATCH) {
+    // Large text is written from where it is rather than copied
+    journalFlush(j);
+    if (journalWrite(j, (char *)&op, sizeof(op)) == 0 &&
+        journalWrite(j, s, len) == 0 && eol)
+      journalWrite(j, "\n", 1);
+    return;
+  }
+
+  j->last = j->pending.len;
+  abAppend(&j->pending, (char *)&op, sizeof(op));
+  if (len) abAppend(&j->pending, s, len);
+  if (eol) abAppend(&j->pending, "\n", 1);
+  if (j->pending.len >= LV_JOURNAL_BATCH) journalFlush(j);
+}
+
+/* Returns the milliseconds left until the journal has to be synced, or -1
+ * if there is nothing to sync
+ */
+int editorJournalDue() {
+  struct journal *j = &E.journal;
+  if (j->pending.len == 0 && !j->unsynced) return -1;
+  long long left = j->synced + j->interval - editorNowMs();
+  return left > 0 ? left : 0;
+}
+
+/* Writes out and syncs every op recorded so far
+ */
+void editorJournalSync() {
+  struct journal *j = &E.journal;
+  journalFlush(j);
+  if (j->unsynced && fdatasync(j->fd) == -1) journalFail(j);
+  j->unsynced = 0;
+  j->synced = editorNowMs();
+}
+
+/* Returns where the ops recorded from now on start in the journal
+ */
+off_t editorJournalMark() {
+  struct journal *j = &E.journal;
+  j->last = -1;
+  return (j->fd == -1 ? (off_t)sizeof(struct journalhead) : j->size) +
+         j->pending.len;
+}
+
+/* Deletes the journal, when the edits in it are saved or thrown away
+ */
+void editorJournalRemove() {
+  struct journal *j = &E.journal;
+  if (j->fd != -1) {
+    close(j->fd);
+    unlink(j->path);
+  }
+  j->fd = -1;
+  j->size = 0;
+  j->pending.len = 0;
+  j->last = -1;
+  j->unsynced = 0;
+}
+
+/* Keeps only the ops recorded from `from` on, once a save has written out
+ * the ones before. They go to a new journal for the file as it is now,
+ * which replaces the old one.
+ */
+void editorJournalCompact(off_t from) {
+  struct journal *j = &E.journal;
+  journalFlush(j);
+  if (j->fd == -1) return;
+  if (j->size <= from) {
+    editorJournalRemove();
+    return;
+  }
+
+  char *tmp = malloc(strlen(j->path) + 5);
+  sprintf(tmp, "%s.tmp", j->path);
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  // The lock has to be on the new journal before it takes the old one's place
+  if (fd != -1) flock(fd, LOCK_EX | LOCK_NB);
+  struct journalhead head;
+  journalHead(&head);
+  int ok = fd != -1 && journalWriteAll(fd, (char *)&head, sizeof(head)) == 0;
+  char buf[65536];
+  for (off_t off = from; ok && off < j->size; ) {
+    ssize_t n = pread(j->fd, buf, sizeof(buf), off);
+    ok = n > 0 && journalWriteAll(fd, buf, n) == 0;
+    off += n;
+  }
+  if (ok) ok = fdatasync(fd) == 0 && rename(tmp, j->path) == 0;
+
+  if (ok) {
+    close(j->fd);
+    j->fd = fd;
+    j->size = sizeof(head) + j->size - from;
+    j->unsynced = 0;
+  } else {
+    if (fd != -1) close(fd);
+    unlink(tmp);
+  }
+  free(tmp);
+}
+
+/* Checks an op read back from a journal against the buffer and applies it.
+ * Returns -1 if it doesn't fit.
+ */
+static int journalApply(struct journalop *op, const char *text) {
+  if (op->y < 0 || op->y > E.numrows || op->x < 0) return -1;
+  int size = op->y < E.numrows ? editorRowAt(op->y)->size : 0;
+  if (op->x > size) return -1;
+
+  if (op->type == UNDO_INSERT) {
+    if (op->len == 0) return -1;
+    if (op->y == E.numrows && text[op->len - 1] != '\n') return -1;
+    editorInsertTextAt(op->y, op->x, text, op->len);
+  } else if (op->type == UNDO_DELETE) {
+    if (op->ey < op->y || op->ey > E.numrows || op->ex < 0) return -1;
+    int esize = op->ey < E.numrows ? editorRowAt(op->ey)->size : 0;
+    if (op->ex > esize || (op->ey == op->y && op->ex < op->x)) return -1;
+    editorDeleteText(op->y, op->x, op->ey, op->ex);
+    E.cy = op->y;
+    E.cx = op->x;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/* Replays the edits that a session before this one recorded but did not get
+ * to save. A journal left for other contents of the file is moved aside,
+ * one cut short stops at its last whole op, and one still in use by another
+ * lv is not touched.
+ */
+void editorJournalRecover() {
+  struct journal *j = &E.journal;
+  j->path = journalPath();
+  int fd = open(j->path, O_RDWR);
+  if (fd == -1) return;
+  if (journalLock(j, fd) == -1) return;
+
+  struct journalhead head, file;
+  journalHead(&file);
+  struct stat st;
+  if (fstat(fd, &st) == -1 ||
+      pread(fd, &head, sizeof(head), 0) != sizeof(head) ||
+      memcmp(&head, &file, sizeof(head)) != 0) {
+    journalSetAside(j, "it is for other contents of the file");
+    close(fd);
+    return;
+  }
+
+  // Every line has to be known before ops can be placed
+  editorLoadWait(INT_MAX);
+  E.undo.suspended++;
+  off_t off = sizeof(head);
+  int ops = 0;
+  struct journalop op;
+  while (pread(fd, &op, sizeof(op), off) == sizeof(op) &&
+         op.len <= (uint64_t)(st.st_size - off - sizeof(op))) {
+    char *text = malloc(op.len + 1);
+    int ok = pread(fd, text, op.len, off + sizeof(op)) == (ssize_t)op.len &&
+             journalHash(text, op.len) == op.sum &&
+             journalApply(&op, text) == 0;
+    free(text);
+    if (!ok) break;
+    off += sizeof(op) + op.len;
+    ops++;
+  }
+  E.undo.suspended--;
+
+  // New ops go after the last one replayed
+  if (ftruncate(fd, off) == -1 || lseek(fd, off, SEEK_SET) == -1) {
+    close(fd);
+    return;
+  }
+  j->fd = fd;
+  j->size = off;
+  j->synced = editorNowMs();
+  editorSetStatusMessage("Recovered %d unsaved edits from %s", ops, j->path);
+}
+
+/*** file i/o ***/
+
+/* Gathers the rows being saved into writev calls
+ */
+struct savewriter {
+  int fd;
+  struct iovec iov[LV_SAVE_IOV];
+  int niov;
+  int nocopy;     // copy_file_range is not available for this file
+  off_t written;
+  off_t done;     // bytes of the buffer handed to the writer so far
+  struct save *sv;
+};
+
+/* Lets the main thread see how far the save has got
+ */
+static void saveProgress(struct savewriter *w) {
+  pthread_mutex_lock(&w->sv->lock);
+  w->sv->done = w->done;
+  pthread_mutex_unlock(&w->sv->lock);
+}
+
+static int saveFlush(struct savewriter *w) {
+  struct iovec *iov = w->iov;
+  int n = w->niov;
+  while (n > 0) {
+    ssize_t done = writev(w->fd, iov, n);
+    if (done == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    w->written += done;
+    // Pick up a short write where it stopped
+    while (n > 0 && (size_t)done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  w->niov = 0;
+  saveProgress(w);
+  return 0;
+}
+
+static int saveAppend(struct savewriter *w, const char *p, size_t len) {
+  if (w->niov == LV_SAVE_IOV && saveFlush(w) == -1) return -1;
+  w->iov[w->niov].iov_base = (void *)p;
+  w->iov[w->niov].iov_len = len;
+  w->niov++;
+  return 0;
+}
+
+/* Copies map[from, to) to the file being saved, inside the kernel when the
+ * file systems allow it. It goes a chunk at a time to report progress.
+ */
+static int saveCopy(struct savewriter *w, size_t from, size_t to) {
+  if (saveFlush(w) == -1) return -1;
+  while (from < to) {
+    size_t len = to - from;
+    if (len > LV_SAVE_CHUNK) len = LV_SAVE_CHUNK;
+    ssize_t n = -1;
+#ifdef __linux__
+    if (!w->nocopy) {
+      loff_t off = from;
+      n = copy_file_range(E.mapfd, &off, w->fd, NULL, len, 0);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) w->nocopy = 1;
+    }
+#endif
+    if (n <= 0) {
+      n = write(w->fd, &E.map[from], len);
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        return -1;
+      }
+    }
+    from += n;
+    w->written += n;
+    w->done += n;
+    saveProgress(w);
+  }
+  return 0;
+}
+
+/* Returns the bytes of the buffer a block stands for, line endings included
+ */
+static size_t saveBlockSize(struct saveblock *b) {
+  if (!b->lines) return b->len + 1;
+  size_t to = editorLineStart(b->line + b->lines);
+  if (to > E.mapsize) to = E.mapsize + 1;
+  return to - editorLineStart(b->line);
+}
+
+/* Takes the snapshot of the rows a save writes out. Spans and rows viewing
+ * the mapping are only referenced, as the mapping never changes, while the
+ * text of owned rows is copied so that edits can't change it under the
+ * writer. Every line has to be known by then.
+ */
+static void saveCollectBlocks(struct save *sv) {
+  int cap = 0;
+  int off;
+  sv->blocks = NULL;
+  sv->nblocks = 0;
+  sv->total = 0;
+  rownode *n = E.rows ? rowTreeFind(0, &off) : NULL;
+  for (; n; n = rowTreeNextNode(n)) {
+    struct saveblock b = {NULL, 0, n->line, n->span, 0};
+    if (!n->span) {
+      erow *row = &n->row;
+      b.chars = row->chars;
+      b.len = row->size;
+      if (row->owned) {
+        char *copy = malloc(row->size + 1);
+        memcpy(copy, row->chars, row->size);
+        b.chars = copy;
+        b.copied = 1;
+      }
+    }
+    if (sv->nblocks == cap) {
+      cap = cap ? cap * 2 : 64;
+      sv->blocks = realloc(sv->blocks, sizeof(struct saveblock) * cap);
+    }
+    sv->blocks[sv->nblocks++] = b;
+    sv->total += saveBlockSize(&b);
+  }
+}
+
+/* Streams the blocks of a save to its file with a '\n' after each line,
+ * without building a copy of the file. Spans of lines that were never
+ * touched are copied straight from the mapped file. Returns the number of
+ * bytes written, or -1.
+ */
+static off_t saveWriteBlocks(struct save *sv) {
+  struct savewriter *w = malloc(sizeof(struct savewriter));
+  w->fd = sv->fd;
+  w->niov = 0;
+  w->nocopy = E.mapfd == -1;
+  w->written = 0;
+  w->done = 0;
+  w->sv = sv;
+
+  int ok = 1;
+  for (int j = 0; j < sv->nblocks && ok; j++) {
+    struct saveblock *b = &sv->blocks[j];
+    if (b->lines && !E.lineidx.crlf) {
+      size_t from = editorLineStart(b->line);
+      size_t to = editorLineStart(b->line + b->lines);
+      // A last line without a '\n' gets one
+      int add = to > E.mapsize;
+      if (add) to = E.mapsize;
+      ok = saveCopy(w, from, to) == 0 && (!add || saveAppend(w, "\n", 1) == 0);
+      w->done += add;
+    } else if (b->lines) {
+      for (int k = 0; k < b->lines && ok; k++) {
+        int len;
+        char *chars = editorMapLine(b->line + k, &len);
+        ok = saveAppend(w, chars, len) == 0 && saveAppend(w, "\n", 1) == 0;
+        size_t to = editorLineStart(b->line + k + 1);
+        if (to > E.mapsize) to = E.mapsize + 1;
+        w->done += to - editorLineStart(b->line + k);
+      }
+    } else {
+      ok = saveAppend(w, b->chars, b->len) == 0 &&
+           saveAppend(w, "\n", 1) == 0;
+      w->done += b->len + 1;
+    }
+  }
+  if (ok) ok = saveFlush(w) == 0;
+
+  off_t written = ok ? w->written : -1;
+  free(w);
+  return written;
+}
+
+/* Writes a save out on its own thread. Unedited rows still view the mapping
+ * of the file being overwritten, so it must not be truncated in place.
+ * Instead the new contents go to a temporary file that is synced and
+ * renamed over the old one, so the old contents stay whole until the new
+ * ones are; the mapping keeps the old inode alive. A file written over in
+ * place has had its mapping moved out of the way first.
+ */
+static void *saveWorker(void *arg) {
+  struct save *sv = arg;
+  off_t len = saveWriteBlocks(sv);
+  if (len != -1 && fsync(sv->fd) == -1) len = -1;
+  if (close(sv->fd) == -1) len = -1;
+  if (len != -1 && sv->tmp && rename(sv->tmp, sv->target) == -1) len = -1;
+  int err = errno;
+
+  if (sv->tmp == NULL) {
+    // Written in place, there is nothing to rename or clean up
+  } else if (len == -1) {
+    unlink(sv->tmp);
+  } else {
+    // Make the rename itself durable
+    char *slash = strrchr(sv->target, '/');
+    if (slash) *slash = '\0';
+    int dir = open(slash ? (slash == sv->target ? "/" : sv->target) : ".",
+                   O_RDONLY);
+    if (dir != -1) {
+      fsync(dir);
+      close(dir);
+    }
+  }
+
+  pthread_mutex_lock(&sv->lock);
+  sv->len = len;
+  sv->err = err;
+  sv->finished = 1;
+  pthread_mutex_unlock(&sv->lock);
+  return NULL;
+}
+
+/* Frees a save whose writer is done and reports how it went. Edits made
+ * after its snapshot was taken still leave the buffer dirty.
+ */
+static void saveFinish(struct save *sv) {
+  for (int j = 0; j < sv->nblocks; j++)
+    if (sv->blocks[j].copied) free((char *)sv->blocks[j].chars);
+  free(sv->blocks);
+  free(sv->tmp);
+  free(sv->target);
+  sv->active = 0;
+
+  if (sv->len != -1) {
+    E.dirty -= sv->dirty;
+    editorJournalCompact(sv->journaled);
+    editorSetStatusMessage("%lld bytes written to disk", (long long)sv->len);
+  } else {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(sv->err));
+  }
+}
+
+/* Retires the running save once it is on disk. Returns 1 while a save is
+ * running too, as its progress is shown.
+ */
+int editorSavePoll() {
+  struct save *sv = &E.save;
+  if (!sv->active) return 0;
+  pthread_mutex_lock(&sv->lock);
+  int finished = sv->finished;
+  pthread_mutex_unlock(&sv->lock);
+  if (finished) {
+    pthread_join(sv->thread, NULL);
+    saveFinish(sv);
+  }
+  return 1;
+}
+
+/* Blocks until the running save, if any, is on disk
+ */
+void editorSaveWait() {
+  if (!E.save.active) return;
+  pthread_join(E.save.thread, NULL);
+  saveFinish(&E.save);
+}
+
+/* Adds the lines the background indexer has published since the last call
+ * to the end of the row tree, which nothing is added past while loading
+ * (see editorLoadTail). Returns 1 if anything changed.
+ */
+int editorLoadPoll() {
+  if (!E.loading) return 0;
+
+  struct lineindex *li = &E.lineidx;
+  pthread_mutex_lock(&li->lock);
+  int lines = li->published;
+  int done = li->done;
+  pthread_mutex_unlock(&li->lock);
+
+  int changed = 0;
+  if (lines > E.loadedlines) {
+    rowTreeInsert(E.numrows,
+                  rowTreeNewSpan(E.loadedlines, lines - E.loadedlines, 0));
+    E.numrows += lines - E.loadedlines;
+    E.loadedlines = lines;
+    changed = 1;
+  }
+  if (done) {
+    pthread_join(li->thread, NULL);
+    E.loading = 0;
+    editorSyntaxScanAll();
+    changed = 1;
+  }
+  return changed;
+}
+
+/* Blocks until the background indexer has published at least `lines` lines
+ * or has reached the end of the file
+ */
+void editorLoadWait(int lines) {
+  struct lineindex *li = &E.lineidx;
+  if (!E.loading) return;
+  pthread_mutex_lock(&li->lock);
+  while (!li->done && li->published < lines)
+    pthread_cond_wait(&li->cond, &li->lock);
+  pthread_mutex_unlock(&li->lock);
+  editorLoadPoll();
+}
+
+/* Maps the file read-only and starts indexing its lines in the background.
+ * No rows are built: lines are added to the row tree as spans as soon as
+ * they are indexed, and only materialized when something looks at them.
+ * Returns -1 if the file can't be mapped.
+ */
+int editorMapFile(int fd, size_t size) {
+  char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return -1;
+
+  E.map = map;
+  E.mapsize = size;
+  editorLineIndexStart();
+
+  // The first screen can be drawn as soon as its lines are known
+  editorLoadWait(E.screenrows);
+  return 0;
+}
+
+/* Moves the mapping of the file into memory of its own if it maps the file
+ * st describes, so that the file can be written over in place without
+ * pulling the text out from under the rows that view it. Unedited lines
+ * are then no longer copied from the file. Returns -1 on failure.
+ */
+static int editorMapRelease(struct stat *st) {
+  struct stat mapst;
+  if (E.mapfd == -1 || fstat(E.mapfd, &mapst) == -1 ||
+      mapst.st_dev != st->st_dev || mapst.st_ino != st->st_ino)
+    return 0;
+
+  char *copy = mmap(NULL, E.mapsize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (copy == MAP_FAILED) return -1;
+  memcpy(copy, E.map, E.mapsize);
+  mprotect(copy, E.mapsize, PROT_READ);
+#ifdef __linux__
+  // Takes the mapping's place in one step, as searches may be reading it
+  if (mremap(copy, E.mapsize, E.mapsize, MREMAP_MAYMOVE | MREMAP_FIXED,
+             E.map) == MAP_FAILED) {
+    munmap(copy, E.mapsize);
+    return -1;
+  }
+#else
+  editorSearchStop();
+  if (mmap(E.map, E.mapsize, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    die("mmap");
+  memcpy(E.map, copy, E.mapsize);
+  mprotect(E.map, E.mapsize, PROT_READ);
+  munmap(copy, E.mapsize);
+#endif
+  close(E.mapfd);
+  E.mapfd = -1;
+  return 0;
+}
+
+void editorOpen(char* filename) {
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  editorSelectSyntaxHighlight();
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+
+  // Regular files are mapped lazily; anything else is read line by line
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      editorMapFile(fd, st.st_size) == 0) {
+    E.mapfd = fd;
+    E.dirty = 0;
+    return;
+  }
+
+  FILE *fp = fdopen(fd, "r");
+  if (!fp) die("fdopen");
+
+  // Loading the file is not an edit that can be undone
+  E.undo.suspended++;
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    // Strip off carriage return or newline
+    while (linelen > 0 && (line[linelen - 1] == '\n' || line [linelen - 1] == '\r'))
+      linelen--;
+    
+    editorInsertRow(E.numrows, line, linelen);
+  }
+  free(line);
+  fclose(fp);
+  E.undo.suspended--;
+  editorSyntaxScanAll();
+  E.dirty = 0;
+}
+
+/* Starts writing the buffer out in the background. A symlink is followed
+ * rather than replaced, and the new file keeps the owner and mode of the
+ * old one. A file that can't be replaced that way, because its directory
+ * isn't writable or its owner can't be given away, is written over in
+ * place instead. A file that isn't writable is left alone.
+ */
+void editorSave() {
+  // Only one save runs at a time, and the last one started wins
+  editorSaveWait();
+
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+
+  // Every line has to be known before the file can be written back
+  editorLoadWait(INT_MAX);
+
+  struct save *sv = &E.save;
+  sv->target = realpath(E.filename, NULL);
+  if (sv->target == NULL) sv->target = strdup(E.filename);
+  struct stat st;
+  int exists = stat(sv->target, &st) == 0;
+  if (exists && access(sv->target, W_OK) == -1) {
+    editorSetStatusMessage("Can't save! %s: %s", E.filename, strerror(errno));
+    free(sv->target);
+    return;
+  }
+
+  // A name of its own, so that saves from two editors can't collide
+  sv->tmp = malloc(strlen(sv->target) + 14);
+  sprintf(sv->tmp, "%s.lvtmp-XXXXXX", sv->target);
+  sv->fd = mkstemp(sv->tmp);
+  if (sv->fd != -1 && exists) {
+    // Owner first, as changing it can clear the set-id bits of the mode
+    if (fchown(sv->fd, st.st_uid, st.st_gid) == -1) {
+      close(sv->fd);
+      unlink(sv->tmp);
+      sv->fd = -1;
+    } else {
+      fchmod(sv->fd, st.st_mode & 07777);
+    }
+  } else if (sv->fd != -1) {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(sv->fd, 0644 & ~mask);
+  }
+
+  if (sv->fd == -1 && exists) {
+    free(sv->tmp);
+    sv->tmp = NULL;
+    if (editorMapRelease(&st) == 0)
+      sv->fd = open(sv->target, O_WRONLY | O_TRUNC);
+  }
+  if (sv->fd == -1) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    free(sv->tmp);
+    free(sv->target);
+    return;
+  }
+
+  saveCollectBlocks(sv);
+  sv->dirty = E.dirty;
+  sv->journaled = editorJournalMark();
+  sv->done = 0;
+  sv->finished = 0;
+  sv->active = 1;
+  if (pthread_create(&sv->thread, NULL, saveWorker, sv) != 0) {
+    saveWorker(sv);
+    saveFinish(sv);
+  }
+}
+
+/*** regex ***/
+
+/*
+ * Regular expressions for Ctrl-R. A pattern is parsed into a tree that is
+ * compiled into two Thompson NFAs: one as written and one for the pattern
+ * reversed. Rows are matched by DFAs built lazily from them, a state set at
+ * a time, so matching never backtracks and is linear in the length of the
+ * row. Supported are literals, '.', classes like [a-z] and [^0-9], the
+ * escapes \d \w \s \D \W \S \t, the anchors ^ and $, alternation, groups
+ * and the repetitions * + ? {m} {m,} {m,n}. Matches are leftmost-longest.
+ */
+
+enum reNodeType {
+  RE_SET = 0,
+  RE_BOL,
+  RE_EOL,
+  RE_EMPTY,
+  RE_CAT,
+  RE_ALT,
+  RE_REPEAT
+};
+
+struct renode {
+  int type;
+  unsigned char set[32];  // bytes matched by RE_SET
+  struct renode *left;
+  struct renode *right;
+  int min, max;           // bounds of RE_REPEAT, max is -1 if unbounded
+};
+
+struct reparser {
+  const char *p;
+  int err;
+};
+
+/* NFA states. RS_START and RS_END assert that the scan is at the start or
+ * at the end of the text, which for the reversed NFA are the end and the
+ * start of the row.
+ */
+enum reStateOp {
+  RS_SET = 0,
+  RS_SPLIT,
+  RS_EMPTY,
+  RS_START,
+  RS_END,
+  RS_MATCH
+};
+
+struct restate {
+  int op;
+  int out;
+  int out1;  // second branch of RS_SPLIT
+  unsigned char set[32];
+};
+
+struct renfa {
+  struct restate *states;
+  int n;
+  int cap;
+  int start;
+  int err;
+};
+
+struct regex {
+  struct renfa fwd;
+  struct renfa rev;
+  char prefix[64];  // literal every match starts with
+  int prefixlen;
+};
+
+/* A state of a lazily built DFA: a set of NFA states. Its transitions are
+ * filled in as they are taken.
+ */
+struct dstate {
+  int *ids;      // sorted NFA states
+  int n;
+  int atstart;   // built for the very start of the text
+  int accept;    // a match ends here
+  int acceptend; // a match ends here if this is the end of the text
+};
+
+struct redfa {
+  struct renfa *nfa;
+  int unanchored;  // a match may start anywhere, not just at the start
+  int earliest;    // stays in the first accepting state it reaches
+  struct dstate *states;
+  int *next;       // 256 transitions per state: -2 until computed, -1 if no
+                   // match can follow
+  int n;
+  int cap;
+  int *table;      // hash table of state sets, as index + 1
+  int start[2];    // start states away from and at the start of the text
+  int flushes;
+  int *stack;
+  int *list;
+  unsigned int *mark;
+  unsigned int gen;
+};
+
+/* The DFAs one thread matches rows with
+ */
+struct reexec {
+  struct redfa any;   // forward, unanchored: is there a match at all
+  struct redfa fwd;   // forward, anchored: how long is the match
+  struct redfa rev;   // reversed, unanchored: where do matches start
+  unsigned char *starts;
+  int startscap;
+};
+
+static void reSetAdd(unsigned char *set, int c) {
+  set[c >> 3] |= 1 << (c & 7);
+}
+
+static int reSetHas(const unsigned char *set, int c) {
+  return set[c >> 3] & (1 << (c & 7));
+}
+
+static struct renode *reNode(int type, struct renode *left,
+                             struct renode *right) {
+  struct renode *n = calloc(1, sizeof(struct renode));
+  n->type = type;
+  n->left = left;
+  n->right = right;
+  return n;
+}
+
+static void reFreeNode(struct renode *n) {
+  if (n == NULL) return;
+  reFreeNode(n->left);
+  reFreeNode(n->right);
+  free(n);
+}
+
+/* Adds the bytes of \d \w \s or their negations \D \W \S to set.
+ * Returns 0 if c names no class.
+ */
+static int reClassEscape(unsigned char *set, int c) {
+  int lower = tolower(c);
+  if (lower != 'd' && lower != 'w' && lower != 's') return 0;
+  unsigned char class[32] = {0};
+  for (int j = 0; j < 256; j++) {
+    int in;
+    if (lower == 'd') in = isdigit(j);
+    else if (lower == 'w') in = isalnum(j) || j == '_';
+    else in = isspace(j);
+    if (in) reSetAdd(class, j);
+  }
+  for (int j = 0; j < 32; j++) set[j] |= isupper(c) ? ~class[j] : class[j];
+  return 1;
+}
+
+static struct renode *reParseAlt(struct reparser *ps);
+
+static struct renode *reParseClass(struct reparser *ps) {
+  struct renode *n = reNode(RE_SET, NULL, NULL);
+  int negate = (*ps->p == '^');
+  if (negate) ps->p++;
+
+  // A ']' right after the '[' is taken literally
+  for (int first = 1; *ps->p && (*ps->p != ']' || first); first = 0) {
+    int lo = (unsigned char)*ps->p++;
+    if (lo == '\\' && *ps->p) {
+      lo = (unsigned char)*ps->p++;
+      if (reClassEscape(n->set, lo)) continue;
+      if (lo == 't') lo = '\t';
+    }
+    int hi = lo;
+    if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+      hi = (unsigned char)ps->p[1];
+      ps->p += 2;
+    }
+    if (hi < lo) ps->err = 1;
+    for (int c = lo; c <= hi; c++) reSetAdd(n->set, c);
+  }
+
+  if (*ps->p == ']') ps->p++;
+  else ps->err = 1;
+  if (negate) {
+    for (int j = 0; j < 32; j++) n->set[j] = ~n->set[j];
+  }
+  return n;
+}
+
+static struct renode *reParseAtom(struct reparser *ps) {
+  struct renode *n;
+  int c = (unsigned char)*ps->p++;
+  switch (c) {
+    case '(':
+      n = reParseAlt(ps);
+      if (*ps->p == ')') ps->p++;
+      else ps->err = 1;
+      return n;
+    case '[':
+      return reParseClass(ps);
+    case '^':
+      return reNode(RE_BOL, NULL, NULL);
+    case '$':
+      return reNode(RE_EOL, NULL, NULL);
+    case '.':
+      n = reNode(RE_SET, NULL, NULL);
+      memset(n->set, 0xff, sizeof(n->set));
+      return n;
+    case '\\':
+      n = reNode(RE_SET, NULL, NULL);
+      c = (unsigned char)*ps->p;
+      if (c == '\0') {
+        ps->err = 1;
+        return n;
+      }
+      ps->p++;
+      if (!reClassEscape(n->set, c)) reSetAdd(n->set, c == 't' ? '\t' : c);
+      return n;
+    default:
+      n = reNode(RE_SET, NULL, NULL);
+      reSetAdd(n->set, c);
+      return n;
+  }
+}
+
+static struct renode *reParseRepeat(struct reparser *ps) {
+  struct renode *n = reParseAtom(ps);
+  while (!ps->err) {
+    int min, max;
+    char c = *ps->p;
+    if (c == '*') {
+      min = 0;
+      max = -1;
+    } else if (c == '+') {
+      min = 1;
+      max = -1;
+    } else if (c == '?') {
+      min = 0;
+      max = 1;
+    } else if (c == '{' && isdigit((unsigned char)ps->p[1])) {
+      char *end;
+      long lo = strtol(ps->p + 1, &end, 10), hi = lo;
+      if (*end == ',') {
+        end++;
+        hi = isdigit((unsigned char)*end) ? strtol(end, &end, 10) : -1;
+      }
+      if (*end != '}' || (hi != -1 && hi < lo) || lo > LV_RE_MAX_REPEAT ||
+          hi > LV_RE_MAX_REPEAT) {
+        ps->err = 1;
+        break;
+      }
+      min = lo;
+      max = hi;
+      ps->p = end;
+    } else {
+      break;
+    }
+    ps->p++;
+    n = reNode(RE_REPEAT, n, NULL);
+    n->min = min;
+    n->max = max;
+  }
+  return n;
+}
+
+static struct renode *reParseConcat(struct reparser *ps) {
+  struct renode *n = NULL;
+  while (!ps->err && *ps->p && *ps->p != '|' && *ps->p != ')') {
+    // A repetition needs something to repeat
+    if (strchr("*+?{", *ps->p)) {
+      ps->err = 1;
+      break;
+    }
+    struct renode *atom = reParseRepeat(ps);
+    n = n ? reNode(RE_CAT, n, atom) : atom;
+  }
+  return n ? n : reNode(RE_EMPTY, NULL, NULL);
+}
+
+static struct renode *reParseAlt(struct reparser *ps) {
+  struct renode *n = reParseConcat(ps);
+  while (!ps->err && *ps->p == '|') {
+    ps->p++;
+    n = reNode(RE_ALT, n, reParseConcat(ps));
+  }
+  return n;
+}
+
+static int nfaAdd(struct renfa *nfa, int op) {
+  if (nfa->n == nfa->cap) {
+    nfa->cap = nfa->cap ? nfa->cap * 2 : 64;
+    nfa->states = realloc(nfa->states, sizeof(struct restate) * nfa->cap);
+  }
+  struct restate *st = &nfa->states[nfa->n];
+  st->op = op;
+  st->out = st->out1 = -1;
+  memset(st->set, 0, sizeof(st->set));
+  return nfa->n++;
+}
+
+/* Compiles node into states entered at *start. Returns the RS_EMPTY state
+ * it leaves through, whose out is left for the caller to set.
+ */
+static int reCompile(struct renfa *nfa, struct renode *node, int reverse,
+                     int *start) {
+  int s, e, a, ae, b, be;
+  if (nfa->n > LV_RE_MAX_STATES) nfa->err = 1;
+  if (nfa->err) {
+    *start = s = nfaAdd(nfa, RS_EMPTY);
+    return s;
+  }
+
+  switch (node->type) {
+    case RE_SET:
+      s = nfaAdd(nfa, RS_SET);
+      memcpy(nfa->states[s].set, node->set, sizeof(node->set));
+      e = nfaAdd(nfa, RS_EMPTY);
+      nfa->states[s].out = e;
+      break;
+
+    case RE_BOL:
+    case RE_EOL:
+      s = nfaAdd(nfa, (node->type == RE_BOL) != reverse ? RS_START : RS_END);
+      e = nfaAdd(nfa, RS_EMPTY);
+      nfa->states[s].out = e;
+      break;
+
+    case RE_CAT:
+      ae = reCompile(nfa, reverse ? node->right : node->left, reverse, &a);
+      be = reCompile(nfa, reverse ? node->left : node->right, reverse, &b);
+      nfa->states[ae].out = b;
+      s = a;
+      e = be;
+      break;
+
+    case RE_ALT:
+      ae = reCompile(nfa, node->left, reverse, &a);
+      be = reCompile(nfa, node->right, reverse, &b);
+      s = nfaAdd(nfa, RS_SPLIT);
+      e = nfaAdd(nfa, RS_EMPTY);
+      nfa->states[s].out = a;
+      nfa->states[s].out1 = b;
+      nfa->states[ae].out = e;
+      nfa->states[be].out = e;
+      break;
+
+    case RE_REPEAT:
+      // The copies that must match, then a loop or the optional copies
+      s = e = nfaAdd(nfa, RS_EMPTY);
+      for (int j = 0; j < node->min; j++) {
+        ae = reCompile(nfa, node->left, reverse, &a);
+        nfa->states[e].out = a;
+        e = ae;
+      }
+      if (node->max == -1) {
+        ae = reCompile(nfa, node->left, reverse, &a);
+        int split = nfaAdd(nfa, RS_SPLIT);
+        int exit = nfaAdd(nfa, RS_EMPTY);
+        nfa->states[e].out = split;
+        nfa->states[split].out = a;
+        nfa->states[split].out1 = exit;
+        nfa->states[ae].out = split;
+        e = exit;
+      } else {
+        int exit = nfaAdd(nfa, RS_EMPTY);
+        for (int j = node->min; j < node->max; j++) {
+          ae = reCompile(nfa, node->left, reverse, &a);
+          int split = nfaAdd(nfa, RS_SPLIT);
+          nfa->states[e].out = split;
+          nfa->states[split].out = a;
+          nfa->states[split].out1 = exit;
+          e = ae;
+        }
+        nfa->states[e].out = exit;
+        e = exit;
+      }
+      break;
+
+    default:
+      s = e = nfaAdd(nfa, RS_EMPTY);
+      break;
+  }
+
+  *start = s;
+  return e;
+}
+
+static int reCompileNFA(struct renfa *nfa, struct renode *root, int reverse) {
+  memset(nfa, 0, sizeof(*nfa));
+  int start;
+  int exit = reCompile(nfa, root, reverse, &start);
+  int match = nfaAdd(nfa, RS_MATCH);
+  nfa->states[exit].out = match;
+  nfa->start = start;
+  return nfa->err ? -1 : 0;
+}
+
+/* Collects the literal bytes every match has to start with. Returns 1 if
+ * node is a literal as a whole, so that what follows it can be added.
+ */
+static int rePrefix(struct renode *node, struct regex *re) {
+  switch (node->type) {
+    case RE_BOL:
+    case RE_EMPTY:
+      return 1;
+    case RE_CAT:
+      return rePrefix(node->left, re) && rePrefix(node->right, re);
+    case RE_SET: {
+      int c = -1;
+      for (int j = 0; j < 256; j++) {
+        if (!reSetHas(node->set, j)) continue;
+        if (c != -1) return 0;
+        c = j;
+      }
+      if (c == -1 || re->prefixlen == (int)sizeof(re->prefix)) return 0;
+      re->prefix[re->prefixlen++] = c;
+      return 1;
+    }
+    default:
+      return 0;
+  }
+}
+
+void regexFree(struct regex *re) {
+  if (re == NULL) return;
+  free(re->fwd.states);
+  free(re->rev.states);
+  free(re);
+}
+
+/* Compiles a pattern. Returns NULL if it isn't a valid one.
+ */
+struct regex *regexCompile(const char *pattern) {
+  struct reparser ps = {pattern, 0};
+  struct renode *root = reParseAlt(&ps);
+  if (*ps.p != '\0') ps.err = 1;  // An unmatched ')'
+
+  struct regex *re = calloc(1, sizeof(struct regex));
+  if (!ps.err) {
+    ps.err = reCompileNFA(&re->fwd, root, 0) || reCompileNFA(&re->rev, root, 1);
+    rePrefix(root, re);
+  }
+  reFreeNode(root);
+  if (ps.err) {
+    regexFree(re);
+    return NULL;
+  }
+  return re;
+}
+
+static void dfaInit(struct redfa *d, struct renfa *nfa, int unanchored,
+                    int earliest) {
+  memset(d, 0, sizeof(*d));
+  d->nfa = nfa;
+  d->unanchored = unanchored;
+  d->earliest = earliest;
+  d->table = calloc(LV_RE_DFA_STATES * 2, sizeof(int));
+  d->stack = malloc(sizeof(int) * (nfa->n + 1));
+  d->list = malloc(sizeof(int) * (nfa->n + 1));
+  d->mark = calloc(nfa->n, sizeof(unsigned int));
+  d->start[0] = d->start[1] = -1;
+}
+
+/* Forgets every state, once the DFA has grown too large
+ */
+static void dfaFlush(struct redfa *d) {
+  for (int j = 0; j < d->n; j++) free(d->states[j].ids);
+  d->n = 0;
+  memset(d->table, 0, sizeof(int) * LV_RE_DFA_STATES * 2);
+  d->start[0] = d->start[1] = -1;
+  d->flushes++;
+}
+
+static void dfaFree(struct redfa *d) {
+  dfaFlush(d);
+  free(d->states);
+  free(d->next);
+  free(d->table);
+  free(d->stack);
+  free(d->list);
+  free(d->mark);
+}
+
+/* Pushes an NFA state onto the closure stack, unless it was seen already
+ */
+static void dfaPush(struct redfa *d, int *sp, int id) {
+  if (d->mark[id] == d->gen) return;
+  d->mark[id] = d->gen;
+  d->stack[(*sp)++] = id;
+}
+
+/* Follows the empty transitions from the given states. Fills d->list with
+ * the states that consume a byte or end the match, and returns how many.
+ */
+static int dfaClosure(struct redfa *d, int *seeds, int nseeds, int atstart,
+                      int atend, int *accept) {
+  struct restate *states = d->nfa->states;
+  int n = 0, sp = 0;
+  *accept = 0;
+  if (++d->gen == 0) {
+    memset(d->mark, 0, sizeof(unsigned int) * d->nfa->n);
+    d->gen = 1;
+  }
+  for (int j = 0; j < nseeds; j++) dfaPush(d, &sp, seeds[j]);
+
+  while (sp > 0) {
+    int id = d->stack[--sp];
+    struct restate *st = &states[id];
+    switch (st->op) {
+      case RS_SPLIT:
+        dfaPush(d, &sp, st->out1);
+        dfaPush(d, &sp, st->out);
+        break;
+      case RS_EMPTY:
+        dfaPush(d, &sp, st->out);
+        break;
+      case RS_START:
+        if (atstart) dfaPush(d, &sp, st->out);
+        break;
+      case RS_END:
+        // Kept, since it holds if the text ends right here
+        if (atend) dfaPush(d, &sp, st->out);
+        else d->list[n++] = id;
+        break;
+      case RS_MATCH:
+        *accept = 1;
+        d->list[n++] = id;
+        break;
+      default:
+        d->list[n++] = id;
+        break;
+    }
+  }
+  return n;
+}
+
+static int intCmp(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+static unsigned int dfaHash(int *ids, int n, int atstart) {
+  unsigned int h = 2166136261u ^ atstart;
+  for (int j = 0; j < n; j++) h = (h ^ ids[j]) * 16777619u;
+  return h;
+}
+
+/* Returns the DFA state for the closure of the given NFA states, adding it
+ * if it is new
+ */
+static int dfaState(struct redfa *d, int *seeds, int nseeds, int atstart) {
+  int accept;
+  int n = dfaClosure(d, seeds, nseeds, atstart, 0, &accept);
+  qsort(d->list, n, sizeof(int), intCmp);
+
+  unsigned int mask = LV_RE_DFA_STATES * 2 - 1;
+  unsigned int h = dfaHash(d->list, n, atstart) & mask;
+  for (; d->table[h]; h = (h + 1) & mask) {
+    struct dstate *st = &d->states[d->table[h] - 1];
+    if (st->n == n && st->atstart == atstart &&
+        !memcmp(st->ids, d->list, sizeof(int) * n))
+      return d->table[h] - 1;
+  }
+
+  if (d->n == LV_RE_DFA_STATES) {
+    dfaFlush(d);
+    return dfaState(d, seeds, nseeds, atstart);
+  }
+  if (d->n == d->cap) {
+    d->cap = d->cap ? d->cap * 2 : 16;
+    d->states = realloc(d->states, sizeof(struct dstate) * d->cap);
+    d->next = realloc(d->next, sizeof(int) * 256 * d->cap);
+  }
+
+  int idx = d->n++;
+  struct dstate *st = &d->states[idx];
+  st->ids = malloc(sizeof(int) * (n + 1));
+  memcpy(st->ids, d->list, sizeof(int) * n);
+  st->n = n;
+  st->atstart = atstart;
+  st->accept = accept;
+  for (int j = 0; j < 256; j++) d->next[idx * 256 + j] = -2;
+  d->table[h] = idx + 1;
+
+  // Whether the match would also be complete at the end of the text
+  int acceptend;
+  dfaClosure(d, st->ids, n, atstart, 1, &acceptend);
+  st->acceptend = acceptend;
+  return idx;
+}
+
+static int dfaStart(struct redfa *d, int atstart) {
+  if (d->start[atstart] < 0) {
+    int seed = d->nfa->start;
+    int st = dfaState(d, &seed, 1, atstart);
+    d->start[atstart] = st;
+  }
+  return d->start[atstart];
+}
+
+/* Returns the state after reading byte c in state st, or -1 if no match
+ * can follow
+ */
+static int dfaNext(struct redfa *d, int st, unsigned char c) {
+  int *next = &d->next[st * 256 + c];
+  if (*next != -2) return *next;
+  if (d->earliest && d->states[st].accept) return *next = st;
+
+  struct restate *states = d->nfa->states;
+  int nseeds = 0;
+  int *seeds = malloc(sizeof(int) * (d->states[st].n + 1));
+  for (int j = 0; j < d->states[st].n; j++) {
+    struct restate *ns = &states[d->states[st].ids[j]];
+    if (ns->op == RS_SET && reSetHas(ns->set, c)) seeds[nseeds++] = ns->out;
+  }
+  if (d->unanchored) seeds[nseeds++] = d->nfa->start;
+
+  int to = -1;
+  if (nseeds > 0) {
+    int flushes = d->flushes;
+    to = dfaState(d, seeds, nseeds, 0);
+    // Unless the states were just flushed, st is still there to remember it
+    if (d->flushes == flushes) d->next[st * 256 + c] = to;
+  } else {
+    *next = -1;
+  }
+  free(seeds);
+  return to;
+}
+
+/* dfaNext, with the transitions already taken kept out of the call
+ */
+static inline int dfaStep(struct redfa *d, int st, unsigned char c) {
+  int next = d->next[st * 256 + c];
+  return next != -2 ? next : dfaNext(d, st, c);
+}
+
+void regexExecInit(struct reexec *ex, struct regex *re) {
+  dfaInit(&ex->any, &re->fwd, 1, 1);
+  dfaInit(&ex->fwd, &re->fwd, 0, 0);
+  dfaInit(&ex->rev, &re->rev, 1, 0);
+  ex->starts = NULL;
+  ex->startscap = 0;
+}
+
+void regexExecFree(struct reexec *ex) {
+  dfaFree(&ex->any);
+  dfaFree(&ex->fwd);
+  dfaFree(&ex->rev);
+  free(ex->starts);
+}
+
+/* Calls emit with the offset and length of every match in a row, leftmost-
+ * longest and without overlaps. Rows that can't match are rejected with a
+ * single forward pass; the others get a backward pass marking where matches
+ * start and a forward pass from each start for its longest match. Like grep,
+ * empty matches only count once, for a row with nothing longer.
+ */
+void regexSearchRow(struct reexec *ex, const char *chars, int len,
+                    void (*emit)(int, int, void *), void *arg) {
+  struct redfa *d = &ex->any;
+  int st = dfaStart(d, 1);
+  for (int i = 0; i < len; i++) st = dfaStep(d, st, chars[i]);
+  if (!d->states[st].acceptend) return;
+
+  if (len + 1 > ex->startscap) {
+    ex->startscap = len + 1;
+    ex->starts = realloc(ex->starts, ex->startscap);
+  }
+  d = &ex->rev;
+  st = dfaStart(d, 1);
+  for (int i = len; i > 0; i--) {
+    ex->starts[i] = d->states[st].accept;
+    st = dfaStep(d, st, chars[i - 1]);
+  }
+  ex->starts[0] = d->states[st].acceptend;
+
+  d = &ex->fwd;
+  int empty = -1, found = 0;
+  for (int s = 0; s <= len; ) {
+    if (!ex->starts[s]) {
+      s++;
+      continue;
+    }
+    int e = -1;
+    st = dfaStart(d, s == 0);
+    for (int i = s; st >= 0; i++) {
+      if (i == len) {
+        if (d->states[st].acceptend) e = i;
+        break;
+      }
+      if (d->states[st].accept) e = i;
+      st = dfaStep(d, st, chars[i]);
+    }
+    if (e <= s) {
+      if (e == s && empty < 0) empty = s;
+      s++;
+      continue;
+    }
+    emit(s, e - s, arg);
+    found = 1;
+    s = e;
+  }
+  if (!found && empty >= 0) emit(empty, 0, arg);
+}
+
+/*** find ***/
+
+/*
+ * Searching works on the text of the buffer rather than on rendered rows.
+ * Spans are scanned as the contiguous blocks of the mapping they are, and
+ * only each match is mapped back to its line, so a search never builds rows
+ * that aren't on the screen. Matches are kept in E.searchhistory in buffer
+ * order.
+ *
+ * The buffer is cut into pieces of about LV_SEARCH_PIECE bytes that a pool
+ * of threads searches in the background. Each piece collects its own
+ * matches, and finished pieces are merged into E.searchhistory in row order
+ * while the editor keeps running (see editorSearchPoll).
+ */
+
+static void searchAddMatch(struct searchpiece *p, int y, int x, int len) {
+  if (p->len == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 16;
+    p->matches = realloc(p->matches, sizeof(struct searchmatch) * p->cap);
+  }
+  p->matches[p->len].x = x;
+  p->matches[p->len].y = y;
+  p->matches[p->len].len = len;
+  p->len++;
+}
+
+/* Calls emit with the offset of every occurrence of q in buf[0, len).
+ * Candidates are the positions where both the first and the last byte of
+ * the query match, found 16 at a time, and are then checked with memcmp.
+ */
+static void searchBlock(const char *buf, size_t len, const char *q, size_t qlen,
+                        void (*emit)(size_t, void *), void *arg) {
+  if (qlen == 0 || len < qlen) return;
+  size_t last = len - qlen;  // last offset a match can start at
+  size_t pos = 0;
+#ifdef __SSE2__
+  const __m128i first = _mm_set1_epi8(q[0]);
+  const __m128i final = _mm_set1_epi8(q[qlen - 1]);
+  while (pos + 16 <= last + 1) {
+    __m128i a = _mm_loadu_si128((const __m128i *)&buf[pos]);
+    __m128i b = _mm_loadu_si128((const __m128i *)&buf[pos + qlen - 1]);
+    unsigned int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+    while (mask) {
+      size_t at = pos + __builtin_ctz(mask);
+      if (qlen <= 2 || memcmp(&buf[at + 1], &q[1], qlen - 2) == 0) emit(at, arg);
+      mask &= mask - 1;
+    }
+    pos += 16;
+  }
+#endif
+  while (pos <= last) {
+    const char *p = memchr(&buf[pos], q[0], last - pos + 1);
+    if (p == NULL) break;
+    pos = p - buf;
+    if (memcmp(p, q, qlen) == 0) emit(pos, arg);
+    pos++;
+  }
+}
+
+/* The block being searched and the piece collecting its matches
+ */
+struct searchemit {
+  struct searchblock b;
+  struct searchpiece *piece;
+  struct search *sr;
+  struct reexec *ex;
+  int lastline;  // last line of a span run through the regex
+};
+
+static void searchEmitRow(size_t off, void *arg) {
+  struct searchemit *e = arg;
+  searchAddMatch(e->piece, e->b.y, off, e->sr->qlen);
+}
+
+/* Moves a span block forward to the line holding mapping offset at. Offsets
+ * arrive in order, so the binary search starts from the previous line.
+ */
+static void searchSpanSeek(struct searchblock *b, size_t at) {
+  int lo = b->line, hi = b->line + b->lines - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (editorLineStart(mid) <= at) lo = mid;
+    else hi = mid - 1;
+  }
+  b->y += lo - b->line;
+  b->lines -= lo - b->line;
+  b->line = lo;
+}
+
+/* Maps a match in a span back to its line
+ */
+static void searchEmitSpan(size_t off, void *arg) {
+  struct searchemit *e = arg;
+  size_t at = (e->b.chars - E.map) + off;
+  searchSpanSeek(&e->b, at);
+  searchAddMatch(e->piece, e->b.y, at - editorLineStart(e->b.line),
+                 e->sr->qlen);
+}
+
+static void searchEmitRegex(int x, int len, void *arg) {
+  struct searchemit *e = arg;
+  searchAddMatch(e->piece, e->b.y, x, len);
+}
+
+/* Runs the regex over the line of a span holding an occurrence of its
+ * literal prefix, once per line
+ */
+static void searchEmitCandidate(size_t off, void *arg) {
+  struct searchemit *e = arg;
+  searchSpanSeek(&e->b, (e->b.chars - E.map) + off);
+  if (e->b.line == e->lastline) return;
+  e->lastline = e->b.line;
+
+  int len;
+  char *chars = editorMapLine(e->b.line, &len);
+  regexSearchRow(e->ex, chars, len, searchEmitRegex, e);
+}
+
+/* Searches a block for a regex. In spans, only the lines holding the
+ * literal prefix of the pattern are looked at, if it has one.
+ */
+static void searchRegexBlock(struct searchemit *e) {
+  struct regex *re = e->sr->re;
+  struct searchblock *b = &e->b;
+  if (b->lines == 0) {
+    regexSearchRow(e->ex, b->chars, b->len, searchEmitRegex, e);
+  } else if (re->prefixlen > 0) {
+    e->lastline = -1;
+    searchBlock(b->chars, b->len, re->prefix, re->prefixlen,
+                searchEmitCandidate, e);
+  } else {
+    for (int j = 0; j < b->lines; j++) {
+      int len;
+      char *chars = editorMapLine(b->line + j, &len);
+      e->b.y = b->y;
+      regexSearchRow(e->ex, chars, len, searchEmitRegex, e);
+      b->y++;
+    }
+  }
+}
+
+static void *searchWorker(void *arg) {
+  struct search *sr = arg;
+  struct reexec ex;  // Lazy DFAs are built per thread
+  if (sr->re) regexExecInit(&ex, sr->re);
+
+  pthread_mutex_lock(&sr->lock);
+  while (!sr->cancel && sr->next < sr->npieces) {
+    struct searchpiece *p = &sr->pieces[sr->order[sr->next++]];
+    pthread_mutex_unlock(&sr->lock);
+
+    for (int j = p->from; j < p->to; j++) {
+      struct searchemit e = {sr->blocks[j], p, sr, &ex, -1};
+      if (sr->re)
+        searchRegexBlock(&e);
+      else
+        searchBlock(e.b.chars, e.b.len, sr->query, sr->qlen,
+                    e.b.lines ? searchEmitSpan : searchEmitRow, &e);
+    }
+
+    pthread_mutex_lock(&sr->lock);
+    p->done = 1;
+    sr->pending--;
+    pthread_cond_broadcast(&sr->cond);
+  }
+  pthread_mutex_unlock(&sr->lock);
+
+  if (sr->re) regexExecFree(&ex);
+  return NULL;
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.rows[at]);
-  memmove(&E.rows[at], &E.rows[at+1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at + 1; j <= E.numrows; j++) E.rows[j].idx--;
-  E.numrows--;
-  E.dirty++;
+static void searchAddBlock(struct search *sr, struct searchblock *b, int *cap) {
+  if (sr->nblocks == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    sr->blocks = realloc(sr->blocks, sizeof(struct searchblock) * *cap);
+  }
+  sr->blocks[sr->nblocks++] = *b;
 }
 
-/*
- * Attempts to insert a new char into the given row
+/* Cuts the buffer into blocks. Spans are split at line boundaries into
+ * blocks of at most a piece each, and the text of owned rows is copied so
+ * that edits can't change it under the workers.
  */
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+static void searchCollectBlocks(struct search *sr) {
+  int cap = 0;
+  int y = 0;
+  int off;
+  rownode *n = E.rows ? rowTreeFind(0, &off) : NULL;
+  for (; n; n = rowTreeNextNode(n)) {
+    if (n->span) {
+      int line = n->line, end = n->line + n->span;
+      while (line < end) {
+        // Take lines until the block holds a piece worth of text
+        size_t start = editorLineStart(line);
+        int lo = line + 1, hi = end;
+        while (lo < hi) {
+          int mid = lo + (hi - lo) / 2;
+          if (editorLineStart(mid) - start < LV_SEARCH_PIECE) lo = mid + 1;
+          else hi = mid;
+        }
+        // The end of a last line without a '\n' lies past the mapping
+        size_t stop = editorLineStart(lo);
+        if (stop > E.mapsize) stop = E.mapsize;
+
+        struct searchblock b = {&E.map[start], stop - start,
+                                y + line - n->line, line, lo - line, 0};
+        searchAddBlock(sr, &b, &cap);
+        line = lo;
+      }
+    } else {
+      erow *row = &n->row;
+      struct searchblock b = {row->chars, row->size, y, 0, 0, row->owned};
+      if (row->owned) {
+        char *copy = malloc(row->size + 1);
+        memcpy(copy, row->chars, row->size);
+        b.chars = copy;
+      }
+      searchAddBlock(sr, &b, &cap);
+    }
+    y += rowTreeWeight(n);
+  }
 }
 
-void editorInsertNewline() {
-  if (E.cx == 0)
-    editorInsertRow(E.cy, "", 0);
-  else {
-    erow *row = &E.rows[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.rows[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+/* Groups consecutive blocks into pieces and orders them starting from the
+ * piece holding the cursor, wrapping around at the end of the buffer
+ */
+static void searchCollectPieces(struct search *sr) {
+  sr->pieces = malloc(sizeof(struct searchpiece) * (sr->nblocks + 1));
+  sr->npieces = 0;
+  int first = 0;
+  for (int j = 0; j < sr->nblocks; ) {
+    struct searchpiece *p = &sr->pieces[sr->npieces];
+    size_t size = 0;
+    p->from = j;
+    while (j < sr->nblocks &&
+           (j == p->from || size + sr->blocks[j].len <= LV_SEARCH_PIECE))
+      size += sr->blocks[j++].len;
+    p->to = j;
+    p->matches = NULL;
+    p->len = p->cap = 0;
+    p->done = 0;
+    if (sr->blocks[p->from].y <= E.cy) first = sr->npieces;
+    sr->npieces++;
   }
-  E.cy++;
-  E.cx = 0;
+
+  sr->order = malloc(sizeof(int) * (sr->npieces + 1));
+  for (int j = 0; j < sr->npieces; j++)
+    sr->order[j] = (first + j) % sr->npieces;
+  sr->next = 0;
+  sr->pending = sr->npieces;
+  sr->merged = 0;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+/* Starts the workers on the pieces that haven't been handed out yet.
+ * Even a single core gets a worker, so that the editor stays responsive,
+ * but a buffer of a single piece is searched right away.
+ */
+static void searchStartWorkers(struct search *sr) {
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > LV_MAX_THREADS) nthreads = LV_MAX_THREADS;
+  if (nthreads > sr->npieces - sr->next) nthreads = sr->npieces - sr->next;
+  if (sr->npieces < 2) nthreads = 0;
+
+  sr->cancel = 0;
+  sr->nthreads = 0;
+  for (int j = 0; j < nthreads; j++) {
+    if (pthread_create(&sr->threads[sr->nthreads], NULL, searchWorker, sr) == 0)
+      sr->nthreads++;
+  }
+  if (sr->nthreads == 0) searchWorker(sr);
 }
 
-/*
- * Attempts to remove a char from a given row
+/* Stops the workers once they are done with the pieces they are on
  */
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at > row->size) return;
-  memmove(&row->chars[at], &row->chars[at+1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+static void searchJoinWorkers(struct search *sr) {
+  pthread_mutex_lock(&sr->lock);
+  sr->cancel = 1;
+  pthread_mutex_unlock(&sr->lock);
+  for (int j = 0; j < sr->nthreads; j++) pthread_join(sr->threads[j], NULL);
+  sr->nthreads = 0;
 }
 
-/*** editor operations ***/
+/* Cancels the running search, if any. Matches already merged are kept.
+ */
+void editorSearchStop() {
+  struct search *sr = &E.search;
+  if (!sr->active) return;
+
+  searchJoinWorkers(sr);
+  for (int j = 0; j < sr->nblocks; j++)
+    if (sr->blocks[j].copied) free((char *)sr->blocks[j].chars);
+  for (int j = 0; j < sr->npieces; j++) free(sr->pieces[j].matches);
+  free(sr->blocks);
+  free(sr->pieces);
+  free(sr->order);
+  sr->active = 0;
+}
 
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+/* Merges the matches of the pieces finished so far into E.searchhistory.
+ * Returns 1 if there were new ones.
+ */
+static int searchMerge(struct search *sr) {
+  pthread_mutex_lock(&sr->lock);
+  int done = sr->npieces - sr->pending;
+  pthread_mutex_unlock(&sr->lock);
+  if (done == sr->merged) return 0;
+  sr->merged = done;
+
+  // Pieces are done in no particular order, so the list is built again
+  E.sh_len = 0;
+  for (int j = 0; j < sr->npieces; j++) {
+    struct searchpiece *p = &sr->pieces[j];
+    pthread_mutex_lock(&sr->lock);
+    int pdone = p->done;
+    pthread_mutex_unlock(&sr->lock);
+    if (!pdone || p->len == 0) continue;
+
+    if (E.sh_len + p->len > E.sh_cap) {
+      while (E.sh_len + p->len > E.sh_cap)
+        E.sh_cap = E.sh_cap ? E.sh_cap * 2 : 16;
+      E.searchhistory =
+          realloc(E.searchhistory, sizeof(struct searchmatch) * E.sh_cap);
+    }
+    memcpy(&E.searchhistory[E.sh_len], p->matches,
+           sizeof(struct searchmatch) * p->len);
+    E.sh_len += p->len;
   }
-  editorRowInsertChar(&E.rows[E.cy], E.cx, c);
-  E.cx++;
+  return 1;
 }
 
-void editorDeleteChar() {
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
+/* Merges new matches of a running search and retires it once every piece
+ * is done. Returns 1 if the matches changed.
+ */
+int editorSearchPoll() {
+  struct search *sr = &E.search;
+  if (!sr->active) return 0;
+  int changed = searchMerge(sr);
+  if (sr->merged == sr->npieces) editorSearchStop();
+  return changed;
+}
 
-  erow *row = &E.rows[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    E.cx = E.rows[E.cy -1].size;
-    editorRowAppendString(&E.rows[E.cy - 1],row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+/* Returns 1 once the first match after the cursor is known: every piece
+ * from the cursor up to the one holding it has been searched
+ */
+static int searchNextKnown(struct search *sr) {
+  for (int k = 0; k < sr->npieces; k++) {
+    struct searchpiece *p = &sr->pieces[sr->order[k]];
+    if (!p->done) return 0;
+    if (p->len == 0) continue;
+    struct searchmatch *m = &p->matches[p->len - 1];
+    if (k > 0 || m->y > E.cy || (m->y == E.cy && m->x > E.cx)) return 1;
   }
+  return 1;
 }
 
-/*** file i/o ***/
-
-/*
- * Returns a string buffer with all the lines in E.rows concatenated
- * for file writing. Writes buflen with the size of the string buffer
+/* Blocks until the match editorFindMoveToMatch would jump to is known, or
+ * until the whole search is done if `all` is set
  */
-char* editorRowsToString(int *buflen) {
-  int totlen = 0;
-  for (int j = 0; j < E.numrows; j++) {
-    totlen += E.rows[j].size + 1;
-  }
-  *buflen = totlen;
+static void editorSearchWait(int all) {
+  struct search *sr = &E.search;
+  if (!sr->active) return;
+  pthread_mutex_lock(&sr->lock);
+  while (sr->pending > 0 && (all || !searchNextKnown(sr)))
+    pthread_cond_wait(&sr->cond, &sr->lock);
+  pthread_mutex_unlock(&sr->lock);
+  editorSearchPoll();
+}
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (int j = 0; j < E.numrows; j++) {
-    memcpy(p, E.rows[j].chars, E.rows[j].size);
-    p += E.rows[j].size + 1;
-    p[-1] = '\n';
+/* Keeps only the matches that still match once the query grew to qlen
+ * bytes, and returns how many are left. Matches are in row order, so rows
+ * are mostly reached by stepping the iterator forward.
+ */
+static int searchRefine(struct searchmatch *m, int len, const char *query,
+                        int qlen) {
+  struct rowiter it;
+  int cur = -1;  // row the iterator last read
+  char *chars = NULL;
+  int rlen = 0;
+  int n = 0;
+  for (int j = 0; j < len; j++) {
+    int y = m[j].y;
+    if (cur < 0 || y < cur || y - cur > 64) {
+      editorRowIterInit(&it, y);
+      cur = y - 1;
+    }
+    while (cur < y && editorRowIterNext(&it, &chars, &rlen)) cur++;
+    if (m[j].x + qlen <= rlen && !memcmp(&chars[m[j].x], query, qlen)) {
+      m[n] = m[j];
+      m[n++].len = qlen;
+    }
   }
-
-  return buf;
+  return n;
 }
 
-void editorOpen(char* filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
-
-  editorSelectSyntaxHighlight();
+/* Narrows the matches of the previous search down to a longer query.
+ * Pieces still being searched pick up the new query where they start.
+ */
+static void searchExtend(struct search *sr, const char *query, int qlen) {
+  if (sr->active) {
+    searchJoinWorkers(sr);
+    for (int j = 0; j < sr->npieces; j++) {
+      struct searchpiece *p = &sr->pieces[j];
+      if (p->done) p->len = searchRefine(p->matches, p->len, query, qlen);
+    }
+  } else {
+    E.sh_len = searchRefine(E.searchhistory, E.sh_len, query, qlen);
+  }
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+  free(sr->query);
+  sr->query = strdup(query);
+  sr->qlen = qlen;
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    // Strip off carriage return or newline
-    while (linelen > 0 && (line[linelen - 1] == '\n' || line [linelen - 1] == '\r'))
-      linelen--;
-    
-    editorInsertRow(E.numrows, line, linelen);
+  if (sr->active) {
+    sr->merged = -1;  // Every piece may have lost matches
+    searchMerge(sr);
+    searchStartWorkers(sr);
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
 }
 
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
-    }
-    editorSelectSyntaxHighlight();
+/* Starts searching the buffer for query in the background, replacing the
+ * matches of the previous search. A literal query that extends the previous
+ * one only narrows down its matches, as long as the buffer hasn't changed.
+ * A regex that doesn't compile matches nothing.
+ */
+void editorSearch(const char *query, int regex) {
+  struct search *sr = &E.search;
+  int qlen = strlen(query);
+  if (E.sh_marked && !regex && !sr->regex && sr->qlen > 0 && qlen > sr->qlen &&
+      !strncmp(query, sr->query, sr->qlen)) {
+    searchExtend(sr, query, qlen);
+    return;
   }
 
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  /* More advanced editors will write to a new, temporary file, and then rename
-   * that file to the actual file the user wants to overwrite, and they’ll carefully
-   * check for errors through the whole process. */
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
-    }
-    close(fd);
+  editorSearchStop();
+  free(sr->query);
+  regexFree(sr->re);
+  sr->query = strdup(query);
+  sr->qlen = qlen;
+  sr->regex = regex;
+  sr->re = NULL;
+  E.sh_len = 0;
+  if (qlen == 0) return;
+  if (regex && (sr->re = regexCompile(query)) == NULL) return;
+
+  sr->blocks = NULL;
+  sr->nblocks = 0;
+  sr->active = 1;
+  searchCollectBlocks(sr);
+  searchCollectPieces(sr);
+  searchStartWorkers(sr);
+}
+
+/* Returns the index of the first match at or after (x, y)
+ */
+static int editorFindMatchFrom(int y, int x) {
+  int lo = 0, hi = E.sh_len;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    struct searchmatch *m = &E.searchhistory[mid];
+    if (m->y < y || (m->y == y && m->x < x)) lo = mid + 1;
+    else hi = mid;
   }
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  return lo;
 }
 
-/*** find ***/
+/* Returns the number of matches on rows [from, to)
+ */
+int editorFindCountRows(int from, int to) {
+  return editorFindMatchFrom(to, 0) - editorFindMatchFrom(from, 0);
+}
 
+/* Moves the cursor `off` matches away from it: to the first match after
+ * the cursor for 0, to the last one before it for -1. Wraps around at
+ * either end of the buffer. Matches an edit has made stale are searched for
+ * again first.
+ */
 void editorFindMoveToMatch(int off) {
-  if (E.sh_len == 0) return;
-  int i = 0;
-  while (E.searchhistory[i].y < E.ry
-    || (E.searchhistory[i].y == E.ry && E.searchhistory[i].x <= E.rx)) { i++; }
-  i = (i + off + E.sh_len) % E.sh_len;
+  struct search *sr = &E.search;
+  if (!E.sh_marked && sr->qlen > 0) {
+    char *query = strdup(sr->query);
+    editorLoadWait(INT_MAX);
+    editorSearch(query, sr->regex);
+    E.sh_marked = 1;
+    free(query);
+  }
 
-  E.rx = E.searchhistory[i].x;
-  E.ry = E.searchhistory[i].y;
-  editorUpdateDataCoords();
+  // Only the next match is needed to move forward
+  editorSearchWait(off < 0);
+  if (E.sh_len == 0) return;
+  int i = editorFindMatchFrom(E.cy, off < 0 ? E.cx : E.cx + 1) + off;
+  i = (i % E.sh_len + E.sh_len) % E.sh_len;
+
+  // Never leave the cursor past the end of the buffer or of its row
+  E.cy = E.searchhistory[i].y;
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  erow *row = editorRowAt(E.cy);
+  E.cx = E.searchhistory[i].x;
+  if (E.cx > (row ? row->size : 0)) E.cx = row ? row->size : 0;
+  editorUpdateRenderCoords();
   E.rowoff = E.cy - (E.screenrows / 2);
   if (E.rowoff < 0) E.rowoff = 0;
+
+  editorSetStatusMessage("Match %d of %d%s, %d on screen", i + 1, E.sh_len,
+                         E.search.active ? "+" : "",
+                         editorFindCountRows(E.rowoff, E.rowoff + E.screenrows));
 }
 
-void editorFindCallback(char *query, int key) {
+static void editorFindUpdate(char *query, int key, int regex) {
   if (key == '\r' || key == '\x1b') return;
 
-  struct saved_hl {
-    int saved_cy;
-    unsigned char* saved_hl;
-  };
-
-  static struct saved_hl *saved_hl_lines;
-  static int saved_hl_size;
-  static int saved_hl_cap;
-
-  if (saved_hl_lines) {
-    for (int i = 0; i < saved_hl_size; i++) {
-      memcpy(E.rows[saved_hl_lines[i].saved_cy].hl,
-             saved_hl_lines[i].saved_hl,
-             E.rows[saved_hl_lines[i].saved_cy].rsize);
-      free(saved_hl_lines[i].saved_hl);
-    }
-    free(saved_hl_lines);
-  }
-  saved_hl_size = 0;
-  saved_hl_cap = 8;
-  saved_hl_lines = malloc(sizeof(struct saved_hl) * saved_hl_cap);
-
-  E.sh_len = 0;
-  free(E.searchhistory);
-  int size = 10;
-  int si = 0;
-  E.searchhistory = malloc(sizeof(struct cords) * size);
-
-  for (int i = 0; i < E.numrows; i++) {
-    erow *row = &E.rows[i];
-    char *p_match = strstr(row->render, query);
-    if (p_match) {
-      saved_hl_size++;
-      if (saved_hl_size >= saved_hl_cap) {
-        saved_hl_cap *= 2;
-        saved_hl_lines = realloc(saved_hl_lines, sizeof(struct saved_hl) * saved_hl_cap);
-      }
-      saved_hl_lines[saved_hl_size-1].saved_hl = malloc(row->rsize);
-      memcpy(saved_hl_lines[saved_hl_size-1].saved_hl, row->hl, row->rsize);
-      saved_hl_lines[saved_hl_size-1].saved_cy = i;
-    }
-    while (p_match != NULL) {
-      E.sh_len++;
-      E.searchhistory[si].x = p_match - row->render + E.lncolwidth - 1;
-      E.searchhistory[si].y = i;
-      si++;
-      if (si >= size) {
-        size *= 2;
-        E.searchhistory = realloc(E.searchhistory, sizeof(struct cords) * size);
-      }
-      
-      memset(&row->hl[p_match - row->render], HL_MATCH, strlen(query));
+  // Search the whole file, as if it had been read in at once
+  editorLoadWait(INT_MAX);
+  editorSearch(query, regex);
+  E.sh_marked = 1;
+  editorFindMoveToMatch(0);
+}
 
-      p_match = strstr(p_match + 1, query);
-    }
-  }
+void editorFindCallback(char *query, int key) {
+  editorFindUpdate(query, key, 0);
+}
 
-  if (si) {
-    editorUpdateDataCoords();
-    editorFindMoveToMatch(0);
-    E.rowoff = E.cy - (E.screenrows / 2);
-    if (E.rowoff < 0) E.rowoff = 0;
-  }
+void editorFindRegexCallback(char *query, int key) {
+  editorFindUpdate(query, key, 1);
 }
 
-void editorFind() {
+void editorFind(int regex) {
   int saved_cx = E.cx, saved_cy = E.cy;
   int saved_coloff = E.coloff, saved_rowoff = E.rowoff;
 
-  char *query = editorPrompt("Search: %s (ESC to cancel)", editorFindCallback);
+  char *query;
+  if (regex)
+    query = editorPrompt("Regex: %s (ESC to cancel)", editorFindRegexCallback);
+  else
+    query = editorPrompt("Search: %s (ESC to cancel)", editorFindCallback);
   if (query) {
     free(query);
   } else {
@@ -788,23 +4842,28 @@ void editorFind() {
 
 /*** append buffer ***/
 
-/* A dynamically managed string buffer
+/* Makes room for len more bytes, doubling the capacity as needed, and
+ * returns where they go. Returns NULL if out of memory.
  */
-struct abuf {
-  char *b;
-  size_t len;
-};
-
-#define ABUF_INIT {NULL, 0}
+char *abReserve(struct abuf *ab, int len) {
+  if (ab->len + len > ab->cap) {
+    size_t cap = ab->cap ? ab->cap : 64;
+    while (cap < ab->len + len) cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) return NULL;
+    ab->b = new;
+    ab->cap = cap;
+  }
+  return &ab->b[ab->len];
+}
 
 /* Append to the string buffer
  */
 void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
+  char *p = abReserve(ab, len);
 
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+  if (p == NULL) return;
+  memcpy(p, s, len);
   ab->len += len;
 }
 
@@ -814,6 +4873,210 @@ void abFree(struct abuf* ab) {
   free(ab->b);
 }
 
+/*** screen ***/
+
+/* Sets up the cell grids and everything else a frame is built with, so
+ * that drawing one allocates nothing
+ */
+void screenInit() {
+  E.screen.front = NULL;
+  E.screen.back = NULL;
+  E.screen.ranges = NULL;
+  E.screen.out = (struct abuf)ABUF_INIT;
+  E.screen.drawn = 0;
+  screenResize();
+
+  for (int fg = 0; fg < 128; fg++)
+    E.screen.sgrlen[fg] = snprintf(E.screen.sgr[fg], sizeof(E.screen.sgr[fg]),
+                                   "\x1b[%dm", fg ? fg : 39);
+}
+
+/* Sizes the cell grids to the terminal, which is measured again
+ */
+void screenResize() {
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1) die("getWindowSize");
+  E.screenrows = rows - 2;
+  E.screencols = cols;
+
+  // Nothing is known about what the terminal shows, so every cell of the
+  // next frame is written
+  int cells = (E.screenrows + 2) * E.screencols;
+  free(E.screen.front);
+  free(E.screen.back);
+  free(E.screen.ranges);
+  E.screen.front = malloc(sizeof(struct cell) * cells);
+  E.screen.back = malloc(sizeof(struct cell) * cells);
+  E.screen.ranges = malloc(sizeof(int) * 2 * (E.screencols + 1));
+  if (E.screen.front == NULL || E.screen.back == NULL ||
+      E.screen.ranges == NULL)
+    die("malloc");
+  memset(E.screen.front, 0, sizeof(struct cell) * cells);
+  E.screen.cx = -1;
+  E.screen.cy = -1;
+  E.screen.rowoff = -1;
+}
+
+/* Writes len bytes of s on row y of the frame being drawn, starting at
+ * column x and clipped to the screen. Returns the column after them.
+ */
+static int screenPut(int y, int x, const char *s, int len,
+                     unsigned char attr) {
+  struct cell *row = &E.screen.back[y * E.screencols];
+  for (int j = 0; j < len && x < E.screencols; j++, x++) {
+    row[x].c = s[j];
+    row[x].attr = attr;
+  }
+  return x;
+}
+
+static int cellEqual(struct cell *a, struct cell *b) {
+  return a->c == b->c && a->attr == b->attr;
+}
+
+/* Returns how many cells from column x on are unchanged, stopping at
+ * column `to`
+ */
+static int cellsUnchanged(struct cell *b, struct cell *f, int x, int to) {
+  int same = x;
+  while (same < to && cellEqual(&b[same], &f[same])) same++;
+  return same - x;
+}
+
+/* Switches the terminal from the attributes in *cur to attr
+ */
+static void screenSetAttr(struct abuf *ab, unsigned char *cur,
+                          unsigned char attr) {
+  if (*cur == attr) return;
+  if ((*cur & CELL_INVERSE) && !(attr & CELL_INVERSE)) {
+    abAppend(ab, "\x1b[m", 3);
+    *cur = 0;
+  }
+  if (!(*cur & CELL_INVERSE) && (attr & CELL_INVERSE))
+    abAppend(ab, "\x1b[7m", 4);
+  int fg = attr & ~CELL_INVERSE;
+  if ((*cur & ~CELL_INVERSE) != fg)
+    abAppend(ab, E.screen.sgr[fg], E.screen.sgrlen[fg]);
+  *cur = attr;
+}
+
+/* Moves the terminal cursor from column *x to row y, column to
+ */
+static void screenMove(struct abuf *ab, int *x, int y, int to) {
+  char buf[32];
+  int len;
+  if (*x >= 0 && to > *x)
+    len = snprintf(buf, sizeof(buf), "\x1b[%dC", to - *x);
+  else
+    len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, to + 1);
+  abAppend(ab, buf, len);
+  *x = to;
+}
+
+/* Has the terminal shift the text rows of the screen up by n lines, or
+ * down for a negative n, and shifts the cells on the terminal to match.
+ * Only the rows scrolled into view are left to be written.
+ */
+static void screenScroll(struct abuf *ab, int n) {
+  int cols = E.screencols, rows = E.screenrows;
+  char buf[32];
+  // Keep the status and message bars out of the scroll region
+  int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", rows,
+                     n > 0 ? n : -n, n > 0 ? 'S' : 'T');
+  abAppend(ab, buf, len);
+
+  struct cell *f = E.screen.front;
+  int keep = (rows - (n > 0 ? n : -n)) * cols;
+  if (n > 0) {
+    memmove(f, &f[n * cols], sizeof(struct cell) * keep);
+    f = &f[keep];
+  } else {
+    memmove(&f[-n * cols], f, sizeof(struct cell) * keep);
+  }
+  for (int j = 0; j < rows * cols - keep; j++) {
+    f[j].c = ' ';
+    f[j].attr = 0;
+  }
+}
+
+/* Appends what it takes to turn the cells on the terminal into the frame
+ * that was drawn, then makes that frame the one on the terminal
+ */
+void screenFlush(struct abuf *ab) {
+  int cols = E.screencols;
+  unsigned char cur = 0;
+
+  // A viewport shift is left to the terminal, which moves the rows that
+  // stay on screen itself
+  int shift = E.rowoff - E.screen.rowoff;
+  if (E.screen.rowoff >= 0 && shift != 0 && shift > -E.screenrows &&
+      shift < E.screenrows)
+    screenScroll(ab, shift);
+  E.screen.rowoff = E.rowoff;
+  for (int y = 0; y < E.screenrows + 2; y++) {
+    struct cell *b = &E.screen.back[y * cols];
+    struct cell *f = &E.screen.front[y * cols];
+    int first = 0, last = cols - 1;
+    while (first < cols && cellEqual(&b[first], &f[first])) first++;
+    if (first == cols) continue;
+    while (cellEqual(&b[last], &f[last])) last--;
+
+    // A multibyte character takes up a single column, so the columns past
+    // it are not where cursor moves would put them. Changes past one are
+    // written out in one go up to the end of the row.
+    int mb = 0;
+    while (mb < cols && (unsigned char)b[mb].c < 0x80 &&
+           (unsigned char)f[mb].c < 0x80)
+      mb++;
+    if (mb <= last) {
+      if (first > mb) first = mb;
+      last = cols - 1;
+    }
+
+    // Blanks at the end of the row are cleared with a single \x1b[K
+    int end = cols;
+    while (end > 0 && b[end - 1].c == ' ' && b[end - 1].attr == 0) end--;
+
+    int tx = -1;  // column of the terminal cursor on this row
+    screenMove(ab, &tx, y, first);
+    int x = first;
+    int to = last + 1 < mb ? last + 1 : mb;  // cursor moves stay before it
+    while (x <= last && x < end) {
+      // Jump over unchanged cells when that is shorter than rewriting them
+      int same = cellsUnchanged(b, f, x, to);
+      if (same > 4) {
+        screenMove(ab, &tx, y, x + same);
+        x += same;
+        continue;
+      }
+
+      // Cells sharing an attribute are appended as one run, along with
+      // short stretches of unchanged ones
+      int run = x + 1;
+      while (run <= last && run < end && b[run].attr == b[x].attr &&
+             cellsUnchanged(b, f, run, to) <= 4)
+        run++;
+      screenSetAttr(ab, &cur, b[x].attr);
+      char *p = abReserve(ab, run - x);
+      if (p != NULL) {
+        for (int j = x; j < run; j++) *p++ = b[j].c;
+        ab->len += run - x;
+      }
+      tx += run - x;
+      x = run;
+    }
+    if (last >= end) {
+      screenSetAttr(ab, &cur, 0);
+      abAppend(ab, "\x1b[K", 3);
+    }
+  }
+  screenSetAttr(ab, &cur, 0);
+
+  struct cell *shown = E.screen.front;
+  E.screen.front = E.screen.back;
+  E.screen.back = shown;
+}
+
 /*** output ***/
 
 /* Scrolls the view by adjusting the offsets at E.rowoff and E.coloff
@@ -858,15 +5121,72 @@ void editorVerticalScroll(int off) {
   // Scroll the screen and restore previous cursor location
   editorScroll();
   E.cy = E.rowoff + dy;
+  if (E.cy > E.numrows) E.cy = E.numrows;
   E.cx = dx;
+
+  // Correct cursor if the restored column is past the end of the new line
+  erow *row = editorRowAt(E.cy);
+  int rowlen = row ? row->size : 0;
+  if (E.cx > rowlen) E.cx = rowlen;
+}
+
+/* Search matches are an overlay: they are drawn over the syntax colors of
+ * the visible rows and never written into hl. Fills ranges with the render
+ * columns [start, end) of the matches on row filerow that are on screen,
+ * starting from match *m, and returns how many there are. *m is left at
+ * the first match of a later row, so a frame walks the matches only once.
+ */
+static int editorMatchRanges(erow *row, int filerow, int *m, int *ranges,
+                             int max) {
+  int n = 0;
+  int scx = 0, srx = 0, ecx = 0, erx = 0;
+  int left = E.coloff, right = E.coloff + E.screencols;
+  for (; *m < E.sh_len && E.searchhistory[*m].y <= filerow; (*m)++) {
+    struct searchmatch *match = &E.searchhistory[*m];
+    if (match->y < filerow || n == max) continue;
+    // Starts and ends both only move right, so one walk over each does
+    int start = editorRowCxToRx(row, &scx, &srx, match->x);
+    int end = editorRowCxToRx(row, &ecx, &erx, match->x + match->len);
+    if (end <= left || start >= right) continue;
+    ranges[2 * n] = start;
+    ranges[2 * n + 1] = end;
+    n++;
+  }
+  return n;
+}
+
+/* Returns how many of the first len bytes of s come before a control
+ * character, checking 16 at a time
+ */
+static int editorPrintableRun(const char *s, int len) {
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(' ' - 1);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  while (i + 16 <= len) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+    // Bytes below ' ' are the ones min leaves unchanged
+    __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(v, space), v);
+    unsigned int mask = _mm_movemask_epi8(
+        _mm_or_si128(low, _mm_cmpeq_epi8(v, del)));
+    if (mask) return i + __builtin_ctz(mask);
+    i += 16;
+  }
+#endif
+  while (i < len && (unsigned char)s[i] >= ' ' && s[i] != 0x7f) i++;
+  return i;
 }
 
 /* Renders our application according to EditorConfig
  */
-void editorDrawRows(struct abuf *ab) {
+void editorDrawRows() {
+  erow *row = editorRowAt(E.rowoff);
+  int hlstate = row ? editorSyntaxStateAt(E.rowoff) : 0;
+  int m = E.sh_marked ? editorFindMatchFrom(E.rowoff, 0) : E.sh_len;
+  int *ranges = E.screen.ranges;
   for (int y = 0; y < E.screenrows; y++) {
     int filerow = y + E.rowoff;
-    if (filerow >= E.numrows) {
+    if (row == NULL) {
       // Add a welcome message if we don't open a file
       if (E.numrows == 0 && y == E.screenrows / 3) {
         char welcome[80];
@@ -875,74 +5195,71 @@ void editorDrawRows(struct abuf *ab) {
         if (welcomelen > E.screencols) welcomelen = E.screencols;
 
         int padding = (E.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+        if (padding) screenPut(y, 0, "~", 1, 0);
+        screenPut(y, padding, welcome, welcomelen, 0);
       } else {
-        abAppend(ab, "~", 1);
+        screenPut(y, 0, "~", 1, 0);
       }
     } else {
-      int len = E.rows[filerow].rsize - E.coloff;
+      hlstate = editorRowHighlight(row, hlstate);
+      int len = row->rsize - E.coloff;
       if (len < 0) len = 0;
       if (len > E.screencols - E.lncolwidth)
         len = E.screencols - E.lncolwidth;
       
       // Draw the line number on the side
+      char linecol[16];
       int relline = (E.cy - E.rowoff) - y < 0 ? y - (E.cy - E.rowoff) : (E.cy - E.rowoff) - y;
       if (relline == 0)
-        snprintf(E.rows[filerow].linecol, E.lncolwidth, "%3d  ", filerow);
+        snprintf(linecol, E.lncolwidth, "%3d  ", filerow);
       else
-        snprintf(E.rows[filerow].linecol, E.lncolwidth, "%4d ", relline);
-      abAppend(ab, E.rows[filerow].linecol, E.lncolwidth);
+        snprintf(linecol, E.lncolwidth, "%4d ", relline);
+      int x = screenPut(y, 0, linecol, E.lncolwidth - 1, 0);
 
       // Draw the row
-      char *c = &E.rows[filerow].render[E.coloff];
-      unsigned char *hl = &E.rows[filerow].hl[E.coloff];
-      int current_color = -1;
-      for (int j = 0; j < len; j++) {
-        // Change color of any numbers
-        if (iscntrl(c[j])) {
+      char *c = &row->render[E.coloff];
+      unsigned char *hl = &row->hl[E.coloff];
+      int current_color = 0;
+
+      // The row is drawn in spans of one color, cut at match boundaries
+      int nranges = editorMatchRanges(row, filerow, &m, ranges, E.screencols);
+      int k = 0;
+      for (int j = 0; j < len;) {
+        int rj = E.coloff + j;
+        while (k < nranges && rj >= ranges[2 * k + 1]) k++;
+        int h, n;
+        if (k < nranges && rj >= ranges[2 * k]) {
+          h = HL_MATCH;
+          n = ranges[2 * k + 1] - rj;
+        } else {
+          h = hl[j];
+          int stop = k < nranges ? ranges[2 * k] - E.coloff : len;
+          if (stop > len) stop = len;
+          n = 1;
+          while (j + n < stop && hl[j + n] == h) n++;
+        }
+        if (n > len - j) n = len - j;
+
+        int printable = editorPrintableRun(&c[j], n);
+        if (printable == 0) {
+          // Control characters keep the color of the text before them
           char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
+          x = screenPut(y, x, &sym, 1, CELL_INVERSE | current_color);
+          j++;
         } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (current_color != color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+          current_color = h == HL_NORMAL ? 0 : editorSyntaxToColor(h);
+          x = screenPut(y, x, &c[j], printable, current_color);
+          j += printable;
         }
       }
-      abAppend(ab, "\x1b[39m", 5);
+      row = editorRowNext(row);
     }
-
-    abAppend(ab, "\x1b[K", 3);  // Clears the current line to the right of the cursor
-    abAppend(ab, "\r\n", 2);
   }
 }
 
 /* A function that draws a status bar for viewing file information
  */
-void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4);  // Switch to inverted colors
+void editorDrawStatusBar() {
   char status[80], rstatus[80];
   /*
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
@@ -951,36 +5268,47 @@ void editorDrawStatusBar(struct abuf *ab) {
                      */
   // DEBUG STATUS BAR
   int len = snprintf(status, sizeof(status), "cx: %d, cy: %d, rx: %d, ry: %d | sh_len: %d | debug1: %d, debug2: %d",
-                     E.cx, E.cy, E.rx, E.ry, E.rows[E.cy].idx,
+                     E.cx, E.cy, E.rx, E.ry, E.sh_len,
                      debug_num_1,
                      debug_num_2);
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                      E.syntax ? E.syntax->filetype : "no ft",
-                      E.cy +1, E.numrows);
+  int rlen;
+  if (E.loading) {
+    // Show how much of the file has been indexed so far
+    pthread_mutex_lock(&E.lineidx.lock);
+    int pct = E.lineidx.scanned * 100 / E.mapsize;
+    pthread_mutex_unlock(&E.lineidx.lock);
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d | loading %d%%",
+                    E.syntax ? E.syntax->filetype : "no ft",
+                    E.cy +1, E.numrows, pct);
+  } else if (E.save.active) {
+    // Show how much of the buffer has been written out so far
+    pthread_mutex_lock(&E.save.lock);
+    int pct = E.save.total ? E.save.done * 100 / E.save.total : 0;
+    pthread_mutex_unlock(&E.save.lock);
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d | saving %d%%",
+                    E.syntax ? E.syntax->filetype : "no ft",
+                    E.cy +1, E.numrows, pct);
+  } else {
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+                    E.syntax ? E.syntax->filetype : "no ft",
+                    E.cy +1, E.numrows);
+  }
 
   if (len > E.screencols) len = E.screencols;
-  abAppend(ab, status, len);
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } else {
-      abAppend(ab, " ", 1);
-      len++;
-    }
-  }
-  abAppend(ab, "\x1b[m", 3);  // Switch back to normal formatting
-  abAppend(ab, "\r\n", 2);
+  int y = E.screenrows;
+  for (int x = 0; x < E.screencols; x++) screenPut(y, x, " ", 1, CELL_INVERSE);
+  screenPut(y, 0, status, len, CELL_INVERSE);
+  if (E.screencols - len >= rlen)
+    screenPut(y, E.screencols - rlen, rstatus, rlen, CELL_INVERSE);
 }
 
 /* A function that draws a message bar for viewing messages from the editor
  */
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+  if (msglen && time(NULL) - E.statusmsg_time < LV_STATUS_SECONDS)
+    screenPut(E.screenrows + 1, 0, E.statusmsg, msglen, 0);
 }
 
 /* A function continuously called to redraw the screen
@@ -989,23 +5317,49 @@ void editorRefreshScreen() {
   editorUpdateRenderCoords();
   editorScroll();
 
-  struct abuf ab = ABUF_INIT;
+  // Every frame starts out blank
+  int cells = (E.screenrows + 2) * E.screencols;
+  for (int j = 0; j < cells; j++) {
+    E.screen.back[j].c = ' ';
+    E.screen.back[j].attr = 0;
+  }
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
 
-  abAppend(&ab, "\x1b[?25l", 6);  // Hide cursor temporarily
-  abAppend(&ab, "\x1b[1;1H", 6);  // Move cursor to the beginning
+  struct abuf *ab = &E.screen.out;
+  ab->len = 0;
+  abAppend(ab, "\x1b[?25l", 6);  // Hide cursor temporarily
+  screenFlush(ab);
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  // Nothing is written at all when neither the frame nor the cursor moved
+  int cy = E.cy - E.rowoff, cx = E.rx - E.coloff;
+  if (ab->len == 6 && cx == E.screen.cx && cy == E.screen.cy) return;
+  E.screen.cx = cx;
+  E.screen.cy = cy;
 
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1,
-                                            E.rx - E.coloff + 1);
-  abAppend(&ab, buf, strlen(buf));  // Move cursor back to the stored x, y position
-  abAppend(&ab, "\x1b[?25h", 6);  // Show cursor again
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, cx + 1);
+  abAppend(ab, buf, strlen(buf));  // Move cursor back to the stored x, y position
+  abAppend(ab, "\x1b[?25h", 6);  // Show cursor again
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  write(STDOUT_FILENO, ab->b, ab->len);
+  E.screen.drawn = editorNowMs();
+}
+
+/* Redraws the screen once there are no keys left to handle first, so a
+ * burst of input is drawn as one frame. Keys that are already waiting, or
+ * that arrive before LV_FRAME_MS have passed since the last frame, go
+ * first, but a frame is still drawn every LV_FRAME_MAX_MS while they keep
+ * coming.
+ */
+void editorRefreshScreenAfterInput() {
+  long long since = editorNowMs() - E.screen.drawn;
+  if (since < LV_FRAME_MAX_MS) {
+    int wait = since < LV_FRAME_MS ? LV_FRAME_MS - since : 0;
+    if (editorKeyPending(wait)) return;
+  }
+  editorRefreshScreen();
 }
 
 /* Takes in a format string and variable number of args
@@ -1030,7 +5384,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
   while (1) {
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    editorRefreshScreenAfterInput();
 
     int c = editorReadKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -1046,6 +5400,21 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
         if (callback) callback(buf, c);
         return buf;
       }
+    } else if (c == PASTE_START) {
+      // Pasted text is typed in, up to its first line
+      struct abuf ab = ABUF_INIT;
+      editorReadPaste(&ab);
+      for (size_t j = 0; j < ab.len && ab.b[j] != '\r' && ab.b[j] != '\n';
+           j++) {
+        if (iscntrl(ab.b[j]) || (unsigned char)ab.b[j] >= 128) continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = ab.b[j];
+        buf[buflen] = '\0';
+      }
+      abFree(&ab);
     } else if (!iscntrl(c) && c < 128) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
@@ -1059,8 +5428,17 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   }
 }
 
+/* Inserts the text of a bracketed paste in one go
+ */
+void editorPaste() {
+  struct abuf ab = ABUF_INIT;
+  editorReadPaste(&ab);
+  editorInsertText(ab.b, ab.len);
+  abFree(&ab);
+}
+
 void editorMoveCursor(int key) {
-  erow *row = E.cy >= E.numrows ? NULL : &E.rows[E.cy];
+  erow *row = editorRowAt(E.cy);
 
   switch (key) {
     case 'h':
@@ -1085,7 +5463,7 @@ void editorMoveCursor(int key) {
   }
 
   // Correct cursor if it ends up outside the bounds of a line via movement
-  row = (E.cy >= E.numrows) ? NULL : &E.rows[E.cy];
+  row = editorRowAt(E.cy);
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen) {
     E.cx = rowlen;
@@ -1097,6 +5475,7 @@ void editorMoveCursor(int key) {
 void editorProcessKeypress() {
   static int quit_times = KILO_QUIT_TIMES;
   int c = editorReadKey();
+  editorUndoBoundary();
 
   switch (c) {
     case '\r':
@@ -1104,19 +5483,35 @@ void editorProcessKeypress() {
       break;
     
     case CTRL_KEY('q'):
+      // A save that is running has to make it to disk first
+      editorSaveWait();
       if (E.dirty && quit_times > 0) {
         editorSetStatusMessage("WARNING!!! File has unsaved chages. Press Ctrl-q %d more times to quit without saving.", quit_times--);
         return;
       }
+      // Quitting throws away what wasn't saved, journal included
+      editorJournalRemove();
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[1;1H", 6);
       exit(0);
       break;
 
+    case PASTE_START:
+      editorPaste();
+      break;
+
     case CTRL_KEY('s'):
       editorSave();
       break;
 
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+
+    case CTRL_KEY('x'):
+      editorRedo();
+      break;
+
     case '0':
     case HOME_KEY:
       E.cx = 0;
@@ -1124,11 +5519,15 @@ void editorProcessKeypress() {
     case '$':
     case END_KEY:
       if (E.cy < E.numrows)
-        E.cx = E.rows[E.cy].size;
+        E.cx = editorRowAt(E.cy)->size;
       break;
 
     case CTRL_KEY('f'):
-      editorFind();
+      editorFind(0);
+      break;
+
+    case CTRL_KEY('r'):
+      editorFind(1);
       break;
 
     case DEL_KEY:
@@ -1166,7 +5565,6 @@ void editorProcessKeypress() {
       break;
 
     case 'n':
-      editorMoveCursor(ARROW_RIGHT);
       editorFindMoveToMatch(0);
       break;
 
@@ -1199,17 +5597,69 @@ void initEditor() {
   E.numrows = 0;
   E.lncolwidth = 6;
   E.rows = NULL;
+  E.map = NULL;
+  E.mapfd = -1;
+  E.mapsize = 0;
+  E.loading = 0;
+  E.loadedlines = 0;
+  E.lru_head = NULL;
+  E.lru_tail = NULL;
+  E.rendermem = 0;
+  E.renderbudget = LV_RENDER_BUDGET;
+  E.hlcheckcap = 64;
+  E.hlcheck = malloc(E.hlcheckcap);
+  E.hlcheck[0] = 0;
+  E.hlvalid = 1;
+
+  // Definitions from the config directory take precedence over HLDB
+  E.syntaxes = NULL;
+  E.nsyntaxes = 0;
+  editorSyntaxLoad();
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+    editorSyntaxCompile(&HLDB[j]);
+    editorSyntaxAdd(&HLDB[j]);
+  }
+
+  // The render cache budget can be overridden in megabytes
+  char *budget = getenv("LV_RENDER_BUDGET");
+  if (budget) E.renderbudget = strtoul(budget, NULL, 10) << 20;
+  // and so can the memory undo history takes before it is spilled to disk
+  memset(&E.undo, 0, sizeof(E.undo));
+  E.undo.fd = -1;
+  E.undo.budget = LV_UNDO_MEMORY;
+  char *undomem = getenv("LV_UNDO_MEMORY");
+  if (undomem) E.undo.budget = strtoul(undomem, NULL, 10) << 20;
+  // The journal is synced this often, in milliseconds
+  memset(&E.journal, 0, sizeof(E.journal));
+  E.journal.fd = -1;
+  E.journal.last = -1;
+  E.journal.interval = LV_JOURNAL_SYNC_MS;
+  char *sync = getenv("LV_JOURNAL_SYNC");
+  if (sync) E.journal.interval = strtol(sync, NULL, 10);
   E.sh_len = 0;
   E.searchhistory = NULL;
+  E.sh_cap = 0;
+  E.sh_marked = 0;
+  E.search.active = 0;
+  E.search.query = NULL;
+  E.search.qlen = 0;
+  E.search.regex = 0;
+  E.search.re = NULL;
+  pthread_mutex_init(&E.search.lock, NULL);
+  pthread_cond_init(&E.search.cond, NULL);
+  E.save.active = 0;
+  pthread_mutex_init(&E.save.lock, NULL);
   E.dirty = 0;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.syntax = NULL;
 
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1)
-    die("getWindowSize");
-  E.screenrows -= 2;
+  E.keys = (struct abuf)ABUF_INIT;
+  E.keypos = 0;
+  E.hangup = 0;
+  screenInit();
+  editorWatchResize();
 }
 
 int main(int argc, char *argv[]) {
@@ -1223,11 +5673,15 @@ int main(int argc, char *argv[]) {
   }
 
   // Add a helpful message to the status bar on startup
-  editorSetStatusMessage("HELP: Ctrl-s = save | Ctrl-q = quit | Ctrl-f = find");
+  editorSetStatusMessage(
+    "HELP: Ctrl-s = save | Ctrl-q = quit | Ctrl-f = find | Ctrl-r = regex");
+
+  // Replay the edits a session that died didn't get to save
+  if (E.filename) editorJournalRecover();
 
   // Editor main loop
   while(1) {
-    editorRefreshScreen();
+    editorRefreshScreenAfterInput();
     editorProcessKeypress();
   }
 